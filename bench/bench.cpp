@@ -0,0 +1,179 @@
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "attacks.h"
+#include "bitops.h"
+#include "rules.h"
+
+using namespace chess;
+
+namespace {
+    struct BenchPosition {
+        const char *name;
+        const char *fen;
+        int depth;
+        std::uint64_t nodes;
+    };
+
+    const BenchPosition POSITIONS[] = {
+            {"start", "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1", 5, 4865609},
+            {"kiwipete", "r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1", 4, 4085603},
+            {"endgame", "8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 0 1", 6, 11030083},
+    };
+
+    // Only the fields the benchmark positions use: placement, side to move, castling and en passant
+    GameState parse_fen(const std::string &fen) {
+        bitmap piece_maps[2][6];
+        std::memset(piece_maps, 0, sizeof(piece_maps));
+
+        std::size_t index = 0;
+        int rank = 7, file = 0;
+        for (; fen[index] != ' '; ++index) {
+            const char symbol = fen[index];
+            if (symbol == '/') {
+                --rank;
+                file = 0;
+            } else if (symbol >= '1' && symbol <= '8') {
+                file += symbol - '0';
+            } else {
+                const Player owner = (symbol >= 'a') ? BLACK : WHITE;
+                const char *found = std::strchr("kqrbnp", symbol >= 'a' ? symbol : symbol - 'A' + 'a');
+                if (found == nullptr) throw std::invalid_argument("Bad piece in FEN: " + fen);
+                piece_maps[owner][found - "kqrbnp"] |= bitmap(1) << (rank * 8 + file);
+                ++file;
+            }
+        }
+
+        const Player to_move = (fen[++index] == 'w') ? WHITE : BLACK;
+        index += 2;
+        bool king_side[2] = {false, false}, queen_side[2] = {false, false};
+        for (; fen[index] != ' '; ++index) {
+            switch (fen[index]) {
+                case 'K': king_side[WHITE] = true; break;
+                case 'Q': queen_side[WHITE] = true; break;
+                case 'k': king_side[BLACK] = true; break;
+                case 'q': queen_side[BLACK] = true; break;
+                default: break;
+            }
+        }
+
+        ++index;
+        square en_passant = INVALID_SQUARE;
+        if (fen[index] != '-') en_passant = (fen[index + 1] - '1') * 8 + (fen[index] - 'a');
+
+        return GameState(to_move, piece_maps, 0, king_side, queen_side, en_passant);
+    }
+
+    std::uint64_t perft(GameState &state, const int depth) {
+        MoveList moves;
+        state.generate_legal(moves);
+        if (depth == 1) return moves.size();
+
+        std::uint64_t nodes = 0;
+        Undo undo;
+        for (const Move move : moves) {
+            state.make_move(move, undo);
+            nodes += perft(state, depth - 1);
+            state.unmake_move(move, undo);
+        }
+        return nodes;
+    }
+
+    double seconds_since(const std::chrono::steady_clock::time_point start) {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    // Runs the same perft workload under whichever sliding backend is installed
+    bool bench_perft() {
+        std::uint64_t total_nodes = 0;
+        const auto start = std::chrono::steady_clock::now();
+        for (const BenchPosition &position : POSITIONS) {
+            GameState state = parse_fen(position.fen);
+            const std::uint64_t nodes = perft(state, position.depth);
+            if (nodes != position.nodes) {
+                std::printf("perft(%s, %d) = %llu, expected %llu\n", position.name, position.depth,
+                            static_cast<unsigned long long>(nodes), static_cast<unsigned long long>(position.nodes));
+                return false;
+            }
+            total_nodes += nodes;
+        }
+        const double elapsed = seconds_since(start);
+        std::printf("  %-6s %llu nodes in %.3f s, %.1f Mnps\n", sliding_backend_name(),
+                    static_cast<unsigned long long>(total_nodes), elapsed, total_nodes / elapsed / 1e6);
+        return true;
+    }
+
+    // The bit scan the move generator used before bitops.h: shift the isolated lowest bit down to one
+    square shifting_lowest_bit(const bitmap map) {
+        square lowest_bit = 0;
+        bitmap lowest_power_of_two = map & (0 - map);
+
+        while (lowest_power_of_two > 1) {
+            lowest_power_of_two >>= 1;
+            ++lowest_bit;
+        }
+
+        return lowest_bit;
+    }
+
+    // Called through a pointer, since the old scan was an out-of-line member function
+    square (*volatile shifting_scan)(bitmap) = shifting_lowest_bit;
+
+    // Iterates over the set bits of random half-full bitmaps, the way the generators walk piece sets
+    void bench_bit_scan() {
+        std::mt19937_64 random(5);
+        std::vector<bitmap> maps(1 << 16);
+        for (bitmap &map : maps) map = random() & random();
+
+        for (int variant = 0; variant < 2; ++variant) {
+            std::uint64_t bits = 0, checksum = 0;
+            const auto start = std::chrono::steady_clock::now();
+            for (int repeat = 0; repeat < 20; ++repeat) {
+                for (bitmap map : maps) {
+                    while (map) {
+                        square start_square;
+                        if (variant == 0) {
+                            start_square = shifting_scan(map);
+                            map ^= bitmap(1) << start_square;
+                        } else {
+                            start_square = pop_lsb(map);
+                        }
+                        checksum += start_square;
+                        ++bits;
+                    }
+                }
+            }
+            const double elapsed = seconds_since(start);
+            std::printf("  %-8s %.2f ns per bit (checksum %llu)\n", variant == 0 ? "shifting" : "pop_lsb",
+                        elapsed * 1e9 / bits, static_cast<unsigned long long>(checksum));
+        }
+    }
+}
+
+int main() {
+    std::printf("info string sliding attacks: %s\n", sliding_backend_name());
+
+    std::printf("perft:\n");
+    const SlidingBackend startup_backend = sliding_backend();
+    bool passed = true;
+    for (const SlidingBackend backend : {SlidingBackend::MAGIC, SlidingBackend::PEXT}) {
+        try {
+            set_sliding_backend(backend);
+        } catch (const std::runtime_error &error) {
+            std::printf("  skipped: %s\n", error.what());
+            continue;
+        }
+        passed = bench_perft() && passed;
+    }
+    set_sliding_backend(startup_backend);
+
+    std::printf("bit scan:\n");
+    bench_bit_scan();
+
+    return passed ? 0 : 1;
+}
@@ -0,0 +1,248 @@
+#include <cassert>
+#include <stdexcept>
+#include "attacks.h"
+
+#if HEPEK_HAS_PEXT
+#include <cpuid.h>
+#endif
+
+namespace chess {
+    namespace attacks {
+        bitmap knight[64];
+        bitmap king[64];
+        Magic rook_magics[64];
+        Magic bishop_magics[64];
+        SlidingBackend sliding_backend = SlidingBackend::MAGIC;
+        bitmap between[64][64];
+        bitmap line[64][64];
+    }
+
+    namespace {
+        // Offsets are given as (file, rank) pairs, so that jumps which would wrap around the edge of the board
+        // can be discarded before being converted to a square index
+        const int KNIGHT_OFFSETS[8][2] = {{1, 2}, {2, 1}, {2, -1}, {1, -2}, {-1, -2}, {-2, -1}, {-2, 1}, {-1, 2}};
+        const int KING_OFFSETS[8][2] = {{0, 1}, {1, 1}, {1, 0}, {1, -1}, {0, -1}, {-1, -1}, {-1, 0}, {-1, 1}};
+        const int ROOK_DIRECTIONS[4][2] = {{0, 1}, {1, 0}, {0, -1}, {-1, 0}};
+        const int BISHOP_DIRECTIONS[4][2] = {{1, 1}, {1, -1}, {-1, -1}, {-1, 1}};
+
+        // Magic multipliers found offline by a randomized search, one per square, with a minimal index width
+        const bitmap ROOK_MAGIC_NUMBERS[64] = {
+                0x0280132180004001ULL, 0x0140001000200040ULL, 0x0880200010000880ULL, 0x2080080005801000ULL,
+                0x0200041020080200ULL, 0x0200041041084200ULL, 0x0400080081124410ULL, 0x2180042100004080ULL,
+                0x8000800099644000ULL, 0x0802003040820100ULL, 0x0105801001862000ULL, 0x0101002008100100ULL,
+                0x1000800400080080ULL, 0x0804800200040080ULL, 0x2001800200800900ULL, 0x00160004088204c1ULL,
+                0x228000c001402000ULL, 0x8510004000200050ULL, 0x3001848020029000ULL, 0x0280808010000801ULL,
+                0x0109010010040800ULL, 0x8000808004000200ULL, 0x8000040081021028ULL, 0x40040a0009004884ULL,
+                0x80c0004280008035ULL, 0x0010004040002000ULL, 0x1101200500410070ULL, 0x8410100080080080ULL,
+                0x000c080080800400ULL, 0x4012008080040002ULL, 0x4000040101000200ULL, 0x0061010200008044ULL,
+                0x0080804010800020ULL, 0x3000201008400040ULL, 0x4112008012002444ULL, 0x0848000880801000ULL,
+                0x00a8008008800400ULL, 0x200200280a00500cULL, 0x080a221024004801ULL, 0xc400008042000104ULL,
+                0x8000400080028022ULL, 0x0220008040018020ULL, 0x4000200011010040ULL, 0x10060040210a0010ULL,
+                0x40820020904a0004ULL, 0x0030040002008080ULL, 0x0200020801840010ULL, 0x0084c04100820004ULL,
+                0x4802010080c2a600ULL, 0x0000400080201880ULL, 0x2040801000200080ULL, 0x0180200842001200ULL,
+                0x0013510008000500ULL, 0x0182000c00808a80ULL, 0x1000524821302400ULL, 0x3800040108488200ULL,
+                0x104a004810210082ULL, 0x0004210010420082ULL, 0xc424110008200241ULL, 0x90101000a0088501ULL,
+                0x0182000420100802ULL, 0x4822001001080402ULL, 0x05d0080090012204ULL, 0x2008140089042846ULL
+        };
+
+        const bitmap BISHOP_MAGIC_NUMBERS[64] = {
+                0x0420220228022c80ULL, 0x200208010c108000ULL, 0x1004010411040040ULL, 0x12a4040292002440ULL,
+                0x0804042082000850ULL, 0x0802020220010440ULL, 0x800401048260201aULL, 0x0041010800828800ULL,
+                0x4040641488080104ULL, 0x20002004016e0020ULL, 0x0c2c223a12420042ULL, 0x0100024081020220ULL,
+                0x0383211041025080ULL, 0x08c0030420160600ULL, 0x0c1000510808c00aULL, 0x40501a0084140280ULL,
+                0x40280040112c0088ULL, 0x4020040908110050ULL, 0x1028001008801412ULL, 0x0104220202020000ULL,
+                0x800a000400940010ULL, 0x0401000200512410ULL, 0x1082012100900408ULL, 0x0101402208440c00ULL,
+                0x00482104c01c1111ULL, 0x0310105008017101ULL, 0x0022010108080020ULL, 0x02300400104010a0ULL,
+                0x1401010011444000ULL, 0x1001020000405020ULL, 0x00010a0804480411ULL, 0x0419220010404400ULL,
+                0x0010020a00200820ULL, 0xa008280909040104ULL, 0x0210209010080020ULL, 0x3006110800040040ULL,
+                0x0800820200440090ULL, 0x0008100421810080ULL, 0x0028060093264800ULL, 0x0a08004088810080ULL,
+                0x3611100290442000ULL, 0x0241081282001001ULL, 0x11081108010d0800ULL, 0x002a102014420800ULL,
+                0x480002600a004500ULL, 0x8001010102000100ULL, 0x2008080810410883ULL, 0x0002080901101022ULL,
+                0x2800942420444080ULL, 0x2000840108024000ULL, 0x0000804844100040ULL, 0x1444120020884540ULL,
+                0x0004001002020c00ULL, 0x041041c801010049ULL, 0x0060045000850810ULL, 0x1003240c14820208ULL,
+                0x3010104a10100800ULL, 0x0280020101580200ULL, 0x1000000101081600ULL, 0x0644009800420200ULL,
+                0x0050040008102402ULL, 0x00000004601c8106ULL, 0x00088530040812a0ULL, 0x800218010102020cULL
+        };
+
+        // Every square gets a slice of 2^(relevant blocker count) entries; these are the totals over the board
+        const int ROOK_TABLE_SIZE = 102400;
+        const int BISHOP_TABLE_SIZE = 5248;
+        bitmap sliding_attack_table[ROOK_TABLE_SIZE + BISHOP_TABLE_SIZE];
+
+        bitmap jumping_attacks(const square start, const int (*offsets)[2]) {
+            bitmap attack_mask = 0;
+
+            for (int i = 0; i < 8; ++i) {
+                const int file = start % 8 + offsets[i][0];
+                const int rank = start / 8 + offsets[i][1];
+                if (file >= 0 && file < 8 && rank >= 0 && rank < 8) {
+                    attack_mask |= (1ULL << (rank * 8 + file));
+                }
+            }
+
+            return attack_mask;
+        }
+
+        // Slow ray walk, only used to fill the magic tables. Rays stop at (and include) the first blocker.
+        bitmap sliding_attacks(const square start, const int (*directions)[2], const bitmap occupancy) {
+            bitmap attack_mask = 0;
+
+            for (int i = 0; i < 4; ++i) {
+                int file = start % 8 + directions[i][0];
+                int rank = start / 8 + directions[i][1];
+                while (file >= 0 && file < 8 && rank >= 0 && rank < 8) {
+                    const bitmap current = 1ULL << (rank * 8 + file);
+                    attack_mask |= current;
+                    if (occupancy & current) break;
+                    file += directions[i][0];
+                    rank += directions[i][1];
+                }
+            }
+
+            return attack_mask;
+        }
+
+        // Squares whose occupancy can change the attack set. The last square of every ray never blocks anything.
+        bitmap relevant_blockers(const square start, const int (*directions)[2]) {
+            bitmap blocker_mask = 0;
+
+            for (int i = 0; i < 4; ++i) {
+                int file = start % 8 + directions[i][0];
+                int rank = start / 8 + directions[i][1];
+                while (file + directions[i][0] >= 0 && file + directions[i][0] < 8 &&
+                       rank + directions[i][1] >= 0 && rank + directions[i][1] < 8) {
+                    blocker_mask |= (1ULL << (rank * 8 + file));
+                    file += directions[i][0];
+                    rank += directions[i][1];
+                }
+            }
+
+            return blocker_mask;
+        }
+
+        bitmap *init_magics(Magic *magics, const bitmap *magic_numbers, const int (*directions)[2],
+                            bitmap *table, const SlidingBackend backend) {
+            for (square start = 0; start < 64; ++start) {
+                Magic &entry = magics[start];
+                entry.mask = relevant_blockers(start, directions);
+                entry.magic = magic_numbers[start];
+                entry.attacks = table;
+
+                const int relevant_bits = popcount(entry.mask);
+                entry.shift = 64 - relevant_bits;
+
+                // Enumerate every subset of the mask (Carry-Rippler trick) and store its attack set
+                bitmap subset = 0;
+                do {
+                    entry.attacks[entry.index(backend, subset)] = sliding_attacks(start, directions, subset);
+                    subset = (subset - entry.mask) & entry.mask;
+                } while (subset > 0);
+
+                table += (1ULL << relevant_bits);
+            }
+
+            return table;
+        }
+
+        // Fills the between and line entries if both squares lie on a common ray of the given slider
+        void init_line(const square first, const square second, const int (*directions)[2]) {
+            const bitmap first_attacks = sliding_attacks(first, directions, 0);
+            if (first == second || (first_attacks & (1ULL << second)) == 0) return;
+
+            const bitmap second_attacks = sliding_attacks(second, directions, 0);
+            attacks::line[first][second] = (first_attacks & second_attacks) | (1ULL << first) | (1ULL << second);
+            attacks::between[first][second] = sliding_attacks(first, directions, 1ULL << second) &
+                                              sliding_attacks(second, directions, 1ULL << first);
+        }
+
+        void init_sliding_tables(const SlidingBackend backend) {
+            bitmap *table_end = init_magics(attacks::rook_magics, ROOK_MAGIC_NUMBERS, ROOK_DIRECTIONS,
+                                            sliding_attack_table, backend);
+            table_end = init_magics(attacks::bishop_magics, BISHOP_MAGIC_NUMBERS, BISHOP_DIRECTIONS, table_end,
+                                    backend);
+            assert(table_end == sliding_attack_table + ROOK_TABLE_SIZE + BISHOP_TABLE_SIZE);
+            (void) table_end;
+            attacks::sliding_backend = backend;
+        }
+
+        void build_attack_tables() {
+            for (square start = 0; start < 64; ++start) {
+                attacks::knight[start] = jumping_attacks(start, KNIGHT_OFFSETS);
+                attacks::king[start] = jumping_attacks(start, KING_OFFSETS);
+            }
+
+            init_sliding_tables(fast_pext_supported() ? SlidingBackend::PEXT : SlidingBackend::MAGIC);
+
+            for (square first = 0; first < 64; ++first) {
+                for (square second = 0; second < 64; ++second) {
+                    init_line(first, second, ROOK_DIRECTIONS);
+                    init_line(first, second, BISHOP_DIRECTIONS);
+                }
+            }
+        }
+
+        // Builds the tables eagerly at startup. Static objects in other translation units may be constructed
+        // before this one, which is why GameState does not rely on it and calls init_attack_tables itself.
+        struct AttackTableInitializer {
+            AttackTableInitializer() {
+                init_attack_tables();
+            }
+        } attack_table_initializer;
+    }
+
+    void init_attack_tables() {
+        // A function-local static is initialized exactly once, even when several threads arrive together
+        static const bool initialized = (build_attack_tables(), true);
+        (void) initialized;
+    }
+
+    bool pext_supported() {
+#if HEPEK_HAS_PEXT
+        unsigned eax, ebx, ecx, edx;
+        if (!__get_cpuid(0, &eax, &ebx, &ecx, &edx) || eax < 7) return false;
+        __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx);
+        return (ebx & (1U << 8)) != 0;
+#else
+        return false;
+#endif
+    }
+
+    bool fast_pext_supported() {
+#if HEPEK_HAS_PEXT
+        if (!pext_supported()) return false;
+
+        unsigned eax = 0, ebx = 0, ecx = 0, edx = 0;
+        __get_cpuid(0, &eax, &ebx, &ecx, &edx);
+        // The vendor string starts in ebx; "Auth" for "AuthenticAMD"
+        const bool is_amd = (ebx == 0x68747541);
+
+        __get_cpuid(1, &eax, &ebx, &ecx, &edx);
+        int family = static_cast<int>((eax >> 8) & 0xf);
+        if (family == 0xf) family += static_cast<int>((eax >> 20) & 0xff);
+
+        // Zen 1 and Zen 2 (family 17h) implement PEXT in microcode, which is slower than a magic multiply
+        return !(is_amd && family < 0x19);
+#else
+        return false;
+#endif
+    }
+
+    SlidingBackend sliding_backend() {
+        init_attack_tables();
+        return attacks::sliding_backend;
+    }
+
+    const char *sliding_backend_name() {
+        return (sliding_backend() == SlidingBackend::PEXT) ? "pext" : "magic";
+    }
+
+    void set_sliding_backend(const SlidingBackend backend) {
+        // Building the tables already executes PEXT, which raises SIGILL on x86-64 CPUs without BMI2
+        if (backend == SlidingBackend::PEXT && !pext_supported()) {
+            throw std::runtime_error("PEXT sliding attacks are not available on this CPU");
+        }
+        // Build everything first, so that the default backend cannot later overwrite this choice
+        init_attack_tables();
+        init_sliding_tables(backend);
+    }
+}
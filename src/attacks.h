@@ -0,0 +1,144 @@
+#ifndef HEPEK_CHESS_ENGINE_ATTACKS_H
+#define HEPEK_CHESS_ENGINE_ATTACKS_H
+
+#include "rules.h"
+
+// PEXT is emitted through inline assembly, so the rest of the program can be compiled without -mbmi2 and the
+// instruction is only ever executed after the CPU has been checked for it
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define HEPEK_HAS_PEXT 1
+#else
+#define HEPEK_HAS_PEXT 0
+#endif
+
+namespace chess {
+    const bitmap FILE_A = 0x0101010101010101ULL;
+    const bitmap FILE_H = FILE_A << 7;
+    const bitmap RANK_1 = 0xFFULL;
+    const bitmap RANK_3 = RANK_1 << 16;
+    const bitmap RANK_6 = RANK_1 << 40;
+    const bitmap RANK_8 = RANK_1 << 56;
+
+    // Moves every square of the set by the given offset; positive offsets point towards the eighth rank.
+    // Callers mask out the edge file first when the offset has a sideways component.
+    inline bitmap shift(const bitmap squares, const int offset) {
+        return (offset > 0) ? (squares << offset) : (squares >> -offset);
+    }
+
+    // Squares attacked by a set of pawns belonging to the given player
+    template<Player player>
+    inline bitmap pawn_attacks(const bitmap pawns) {
+        if (player == Player::WHITE) return ((pawns & ~FILE_A) << 7) | ((pawns & ~FILE_H) << 9);
+        return ((pawns & ~FILE_H) >> 7) | ((pawns & ~FILE_A) >> 9);
+    }
+
+    inline bitmap pawn_attacks(const Player player, const bitmap pawns) {
+        if (player == Player::WHITE) return pawn_attacks<Player::WHITE>(pawns);
+        return pawn_attacks<Player::BLACK>(pawns);
+    }
+
+    // How sliding piece attack table indices are computed
+    enum SlidingBackend {
+        MAGIC = 0, PEXT = 1
+    };
+
+    // Parallel bit extract: packs the bits of value selected by mask into the low bits of the result
+    inline bitmap pext(const bitmap value, const bitmap mask) {
+#if HEPEK_HAS_PEXT
+        bitmap result;
+        asm("pextq %2, %1, %0" : "=r"(result) : "r"(value), "r"(mask));
+        return result;
+#else
+        (void) value;
+        (void) mask;
+        return 0;
+#endif
+    }
+
+    // Per-square entry of the sliding attack tables. The relevant blockers of a slider are mapped into a
+    // per-square slice of the shared attack table, either by a magic multiply and shift or by PEXT.
+    struct Magic {
+        bitmap mask;
+        bitmap magic;
+        bitmap *attacks;
+        unsigned shift;
+
+        unsigned index(SlidingBackend backend, bitmap occupancy) const;
+    };
+
+    // Precomputed attack tables, filled in once by init_attack_tables
+    namespace attacks {
+        extern bitmap knight[64];
+        extern bitmap king[64];
+        extern Magic rook_magics[64];
+        extern Magic bishop_magics[64];
+        extern SlidingBackend sliding_backend;
+        extern bitmap between[64][64];
+        extern bitmap line[64][64];
+    }
+
+    inline unsigned Magic::index(const SlidingBackend backend, const bitmap occupancy) const {
+        if (backend == SlidingBackend::PEXT) return static_cast<unsigned>(pext(occupancy, mask));
+        return static_cast<unsigned>(((occupancy & mask) * magic) >> shift);
+    }
+
+    // Builds the attack tables on first call; later calls return at once. Safe to call from several threads.
+    // GameState constructors call it, so only lookups made before any GameState exists need to call it first.
+    void init_attack_tables();
+
+    // Whether this CPU can execute PEXT at all (BMI2), however slowly
+    bool pext_supported();
+
+    // Whether this CPU has a fast PEXT instruction (BMI2 on Intel, or AMD from Zen 3 onwards, where it is no
+    // longer microcoded)
+    bool fast_pext_supported();
+
+    // Backend picked at startup: PEXT if the CPU runs it fast, magic bitboards otherwise
+    SlidingBackend sliding_backend();
+
+    const char *sliding_backend_name();
+
+    // Rebuilds the sliding attack tables for the given backend. Not thread-safe; meant for startup
+    // configuration and benchmarking the two backends against each other. Throws std::runtime_error when asked
+    // for PEXT on a CPU without it.
+    void set_sliding_backend(SlidingBackend backend);
+
+    // Squares attacked by a knight standing on the given square
+    inline bitmap knight_attacks(const square start) {
+        return attacks::knight[start];
+    }
+
+    // Squares attacked by a king standing on the given square
+    inline bitmap king_attacks(const square start) {
+        return attacks::king[start];
+    }
+
+    // Squares attacked by a rook standing on the given square, given the occupancy of the whole board
+    inline bitmap rook_attacks(const square start, const bitmap occupancy) {
+        const Magic &entry = attacks::rook_magics[start];
+        return entry.attacks[entry.index(attacks::sliding_backend, occupancy)];
+    }
+
+    // Squares attacked by a bishop standing on the given square, given the occupancy of the whole board
+    inline bitmap bishop_attacks(const square start, const bitmap occupancy) {
+        const Magic &entry = attacks::bishop_magics[start];
+        return entry.attacks[entry.index(attacks::sliding_backend, occupancy)];
+    }
+
+    // Squares strictly between two squares sharing a rank, file or diagonal; empty if they are not aligned
+    inline bitmap squares_between(const square first, const square second) {
+        return attacks::between[first][second];
+    }
+
+    // The full rank, file or diagonal through two squares; empty if they are not aligned
+    inline bitmap line_through(const square first, const square second) {
+        return attacks::line[first][second];
+    }
+
+    inline bitmap queen_attacks(const square start, const bitmap occupancy) {
+        return rook_attacks(start, occupancy) | bishop_attacks(start, occupancy);
+    }
+}
+
+
+#endif //HEPEK_CHESS_ENGINE_ATTACKS_H
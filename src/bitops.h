@@ -0,0 +1,102 @@
+#ifndef HEPEK_CHESS_ENGINE_BITOPS_H
+#define HEPEK_CHESS_ENGINE_BITOPS_H
+
+#include <cassert>
+
+#if defined(_MSC_VER) && defined(_M_X64) && !defined(__clang__)
+#include <intrin.h>
+#endif
+
+namespace chess {
+    typedef unsigned long long bitmap;
+    typedef int square;
+
+    // Bit scans and population counts on bitmaps. GCC and Clang compile the builtins to tzcnt/bsf, lzcnt/bsr and
+    // popcnt where the target allows it; other compilers get the MSVC intrinsics or a portable fallback.
+#if defined(__GNUC__) || defined(__clang__)
+
+    inline square lsb(const bitmap map) {
+        assert(map > 0);
+        return __builtin_ctzll(map);
+    }
+
+    inline square msb(const bitmap map) {
+        assert(map > 0);
+        return 63 ^ __builtin_clzll(map);
+    }
+
+    inline int popcount(const bitmap map) {
+        return __builtin_popcountll(map);
+    }
+
+#elif defined(_MSC_VER) && defined(_M_X64)
+
+    inline square lsb(const bitmap map) {
+        assert(map > 0);
+        unsigned long index;
+        _BitScanForward64(&index, map);
+        return static_cast<square>(index);
+    }
+
+    inline square msb(const bitmap map) {
+        assert(map > 0);
+        unsigned long index;
+        _BitScanReverse64(&index, map);
+        return static_cast<square>(index);
+    }
+
+    inline int popcount(const bitmap map) {
+        return static_cast<int>(__popcnt64(map));
+    }
+
+#else
+
+    // De Bruijn multiplication: isolating a single bit and multiplying by the sequence yields a unique top 6 bits
+    const bitmap DE_BRUIJN_SEQUENCE = 0x03f79d71b4cb0a89ULL;
+    const square DE_BRUIJN_INDEX[64] = {
+            0, 47, 1, 56, 48, 27, 2, 60, 57, 49, 41, 37, 28, 16, 3, 61,
+            54, 58, 35, 52, 50, 42, 21, 44, 38, 32, 29, 23, 17, 11, 4, 62,
+            46, 55, 26, 59, 40, 36, 15, 53, 34, 51, 20, 43, 31, 22, 10, 45,
+            25, 39, 14, 33, 19, 30, 9, 24, 13, 18, 8, 12, 7, 6, 5, 63
+    };
+
+    inline square lsb(const bitmap map) {
+        assert(map > 0);
+        return DE_BRUIJN_INDEX[((map ^ (map - 1)) * DE_BRUIJN_SEQUENCE) >> 58];
+    }
+
+    inline square msb(bitmap map) {
+        assert(map > 0);
+        // Smear the highest bit downwards, so that the same lookup applies
+        map |= map >> 1;
+        map |= map >> 2;
+        map |= map >> 4;
+        map |= map >> 8;
+        map |= map >> 16;
+        map |= map >> 32;
+        return DE_BRUIJN_INDEX[(map * DE_BRUIJN_SEQUENCE) >> 58];
+    }
+
+    inline int popcount(bitmap map) {
+        map = map - ((map >> 1) & 0x5555555555555555ULL);
+        map = (map & 0x3333333333333333ULL) + ((map >> 2) & 0x3333333333333333ULL);
+        map = (map + (map >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+        return static_cast<int>((map * 0x0101010101010101ULL) >> 56);
+    }
+
+#endif
+
+    // Removes the lowest set bit from the map and returns its index
+    inline square pop_lsb(bitmap &map) {
+        const square lowest_bit = lsb(map);
+        map &= map - 1;
+        return lowest_bit;
+    }
+
+    inline bool more_than_one(const bitmap map) {
+        return (map & (map - 1)) != 0;
+    }
+}
+
+
+#endif //HEPEK_CHESS_ENGINE_BITOPS_H
@@ -1,91 +1,166 @@
+#include <algorithm>
 #include <exception>
 #include <cassert>
 #include <stdexcept>
 #include "rules.h"
+#include "attacks.h"
+#include "transposition.h"
 
 namespace chess {
+    namespace {
+        const std::uint8_t ALL_CASTLING_RIGHTS = 15;
+
+        // Castling rights given up for good by a move starting or ending on the square: moving the king or a
+        // rook, or capturing a rook on its starting square
+        std::uint8_t castling_rights_lost(const square location) {
+            switch (location) {
+                case 0: return castling_bit(Player::WHITE, QUEEN_SIDE);
+                case 4: return castling_bit(Player::WHITE, KING_SIDE) | castling_bit(Player::WHITE, QUEEN_SIDE);
+                case 7: return castling_bit(Player::WHITE, KING_SIDE);
+                case 56: return castling_bit(Player::BLACK, QUEEN_SIDE);
+                case 60: return castling_bit(Player::BLACK, KING_SIDE) | castling_bit(Player::BLACK, QUEEN_SIDE);
+                case 63: return castling_bit(Player::BLACK, KING_SIDE);
+                default: return 0;
+            }
+        }
+    }
+
     /*****************************
      * GameState constructors
      *****************************/
     GameState::GameState() {
         to_move = Player::WHITE;
         half_move_counter = 0;
-        std::fill(can_castle_king_side, can_castle_king_side + 2, true);
-        std::fill(can_castle_queen_side, can_castle_queen_side + 2, true);
+        castling_rights = ALL_CASTLING_RIGHTS;
         en_passant_square = INVALID_SQUARE;
 
         // Fill starting board
-        std::fill(&pieces[0][0], &pieces[0][0] + 12, 0ULL);
+        std::fill(by_type, by_type + 6, 0ULL);
 
-        pieces[Player::WHITE][Piece::KING] |= (1ULL << 4);
-        pieces[Player::BLACK][Piece::KING] |= (1ULL << 60);
+        by_type[Piece::KING] = (1ULL << 4) | (1ULL << 60);
+        by_type[Piece::QUEEN] = (1ULL << 3) | (1ULL << 59);
+        by_type[Piece::ROOK] = (1ULL << 0) | (1ULL << 7) | (1ULL << 56) | (1ULL << 63);
+        by_type[Piece::BISHOP] = (1ULL << 2) | (1ULL << 5) | (1ULL << 58) | (1ULL << 61);
+        by_type[Piece::KNIGHT] = (1ULL << 1) | (1ULL << 6) | (1ULL << 57) | (1ULL << 62);
+        by_type[Piece::PAWN] = RANK_1 << 8 | RANK_1 << 48;
+
+        by_color[Player::WHITE] = RANK_1 | RANK_1 << 8;
+        by_color[Player::BLACK] = RANK_1 << 48 | RANK_8;
+
+        init_board();
+    }
 
-        pieces[Player::WHITE][Piece::QUEEN] |= (1ULL << 3);
-        pieces[Player::BLACK][Piece::QUEEN] |= (1ULL << 59);
+    GameState::GameState(const Player to_move, const bitmap piece_maps[2][6], const int half_move_counter,
+                         const bool *can_castle_king_side, const bool *can_castle_queen_side,
+                         const square en_passant_square) {
+        this->to_move = to_move;
+        this->half_move_counter = static_cast<std::uint8_t>(std::min(half_move_counter, 255));
+        this->en_passant_square = static_cast<std::int8_t>(en_passant_square);
+
+        castling_rights = 0;
+        for (const Player player: {Player::WHITE, Player::BLACK}) {
+            if (can_castle_king_side[player]) castling_rights |= castling_bit(player, KING_SIDE);
+            if (can_castle_queen_side[player]) castling_rights |= castling_bit(player, QUEEN_SIDE);
+        }
 
-        pieces[Player::WHITE][Piece::ROOK] |= ((1ULL << 0) | (1ULL << 7));
-        pieces[Player::BLACK][Piece::ROOK] |= ((1ULL << 56) | (1ULL << 63));
+        std::fill(by_type, by_type + 6, 0ULL);
+        std::fill(by_color, by_color + 2, 0ULL);
+        for (int player = 0; player < 2; ++player) {
+            for (int i = 0; i < 6; ++i) {
+                by_type[i] |= piece_maps[player][i];
+                by_color[player] |= piece_maps[player][i];
+            }
+        }
 
-        pieces[Player::WHITE][Piece::BISHOP] |= ((1ULL << 2) | (1ULL << 5));
-        pieces[Player::BLACK][Piece::BISHOP] |= ((1ULL << 58) | (1ULL << 61));
+        init_board();
+    }
 
-        pieces[Player::WHITE][Piece::KNIGHT] |= ((1ULL << 1) | (1ULL << 6));
-        pieces[Player::BLACK][Piece::KNIGHT] |= ((1ULL << 57) | (1ULL << 62));
+    void GameState::init_board() {
+        // Static GameStates may be built before the tables' own static initializers have run
+        init_attack_tables();
+        init_zobrist_keys();
 
-        for (int i = 8; i < 16; ++i) {
-            pieces[Player::WHITE][Piece::PAWN] |= (1ULL << i);
-            pieces[Player::BLACK][Piece::PAWN] |= (1ULL << (63 - i));
+        // Derive the mailbox and the check information from the piece bitboards
+        std::fill(board, board + 64, NO_PIECE);
+        for (int player = 0; player < 2; ++player) {
+            for (int i = 0; i < 6; ++i) {
+                bitmap piece_locations = pieces(static_cast<Player>(player), static_cast<Piece>(i));
+                while (piece_locations > 0) {
+                    const square location = pop_lsb(piece_locations);
+                    board[location] = make_piece(static_cast<Player>(player), static_cast<Piece>(i));
+                }
+            }
         }
+
+        // Rights whose king or rook is not on its starting square cannot be used again
+        for (const Player player: {Player::WHITE, Player::BLACK}) {
+            const square king_square = (player == Player::WHITE) ? 4 : 60;
+            for (const square rook_square: {king_square + 3, king_square - 4}) {
+                if (board[king_square] != make_piece(player, Piece::KING) ||
+                    board[rook_square] != make_piece(player, Piece::ROOK)) {
+                    castling_rights &= ~castling_rights_lost(rook_square);
+                }
+            }
+        }
+
+        // Like make_move, only remember an en passant square when a pawn can actually capture there
+        const auto opponent = static_cast<Player>(to_move ^ 1);
+        if (en_passant_square != INVALID_SQUARE &&
+            (pawn_attacks(opponent, 1ULL << en_passant_square) & pieces(to_move, Piece::PAWN)) == 0) {
+            en_passant_square = INVALID_SQUARE;
+        }
+
+        key = compute_key();
+        update_check_info();
     }
 
-    GameState::GameState(const Player to_move, const bitmap **pieces, const int half_move_counter,
-                         const bool *can_castle_king_side, const bool *can_castle_queen_side,
-                         const square en_passant_square)
-            : to_move(to_move), half_move_counter(half_move_counter),
-              en_passant_square(en_passant_square) {
-        std::copy(&pieces[0][0], &pieces[0][0] + 12, &(this->pieces[0][0]));
-        std::copy(can_castle_king_side, can_castle_king_side + 2, this->can_castle_king_side);
-        std::copy(can_castle_queen_side, can_castle_queen_side + 2, this->can_castle_queen_side);
+    zobrist_key GameState::compute_key() const {
+        zobrist_key full_key = 0;
+        for (square location = 0; location < 64; ++location) {
+            if (board[location] != NO_PIECE) full_key ^= zobrist::piece_square[board[location]][location];
+        }
+        if (to_move == Player::BLACK) full_key ^= zobrist::black_to_move;
+        full_key ^= zobrist::castling[castling_rights];
+        if (en_passant_square != INVALID_SQUARE) full_key ^= zobrist::en_passant_file[en_passant_square & 7];
+        return full_key;
     }
 
 
     /*****************************
      * GameState member functions
      *****************************/
-
-    // NOTE: Should be optimized
-    square GameState::get_lowest_bit(const bitmap map) {
-        square lowest_bit = 0;
-        bitmap lowest_power_of_two = map & (-map);
-
-        while (lowest_power_of_two > 0) {
-            lowest_power_of_two >>= 1;
-            ++lowest_bit;
+    namespace {
+        // Which kinds of moves each generator type produces
+        constexpr bool generates_captures(const GenType type) {
+            return type != GenType::QUIETS && type != GenType::QUIET_CHECKS;
         }
 
-        return lowest_bit;
+        constexpr bool generates_quiets(const GenType type) {
+            return type != GenType::CAPTURES;
+        }
     }
 
-    bitmap GameState::get_occupancy_map() const {
-        bitmap mask = 0;
-        for (int i = 0; i < 6; ++i) {
-            mask |= (pieces[0][i] | pieces[1][i]);
-        }
-        return mask;
+    square GameState::get_lowest_bit(const bitmap map) {
+        return lsb(map);
     }
 
     bitmap GameState::get_attack_map(const Player player) const {
-        bitmap attack_map = 0;
+        if (player == Player::WHITE) return get_attack_map<Player::WHITE>(occupancy());
+        return get_attack_map<Player::BLACK>(occupancy());
+    }
+
+    template<Player player>
+    bitmap GameState::get_attack_map(const bitmap occupancy_map) const {
+        // Pawns attack set-wise; every other piece contributes its attacks one by one
+        bitmap attack_map = pawn_attacks<player>(pieces(player, Piece::PAWN));
 
-        for (int i = 0; i < 6; ++i) {
-            bitmap piece_locations = pieces[player][i];
+        for (int i = Piece::KING; i < Piece::PAWN; ++i) {
             const auto piece_type(static_cast<Piece>(i));
+            bitmap piece_locations = pieces(player, piece_type);
 
             while (piece_locations > 0) {
-                const square start = get_lowest_bit(piece_locations);
-                bitmap piece_attack = attacking(start, player, piece_type);
-                attack_map |= piece_attack;
-                piece_locations ^= (1ULL << start);
+                const square start = pop_lsb(piece_locations);
+                attack_map |= attacking(start, player, piece_type, occupancy_map);
             }
         }
 
@@ -93,245 +168,591 @@ namespace chess {
     }
 
     square GameState::get_king_position(const Player player) const {
-        return get_lowest_bit(pieces[player][0]);
+        return lsb(pieces(player, Piece::KING));
     }
 
-    // NOTE: Should be optimized
-    bool GameState::in_check_after_move(const std::unique_ptr<Move> &move) const {
-        GameState new_state = move->transform(*this);
-        const bitmap attack_map = new_state.get_attack_map(static_cast<Player>(to_move ^ 1));
-        const square king_position = new_state.get_king_position(to_move);
-        return attack_map & (1ULL << king_position);
+    Piece GameState::get_piece_type(const Player player, const square query) const {
+        if (board[query] == NO_PIECE || owner_of(board[query]) != player)
+            throw std::logic_error("Square is not occupied by the given player");
+        return type_of(board[query]);
     }
 
-    bool GameState::king_side_castling_conditions_satisfied() const {
-        bitmap in_between_squares, passing_squares;
-        if (to_move == Player::WHITE) {
-            in_between_squares = (1ULL << 5) | (1ULL << 6);
-            passing_squares = (1ULL << 4) | (1ULL << 5) | (1ULL << 6);
-        } else {
-            in_between_squares = (1ULL << 61) | (1ULL << 62);
-            passing_squares = (1ULL << 60) | (1ULL << 61);
+    bitmap GameState::attackers_to(const square target, const bitmap occupancy_map) const {
+        // A piece attacks the target exactly when the same piece standing on the target would attack it back;
+        // pawns are the exception, as they attack in the direction opposite to that of the other color
+        const bitmap target_bit = 1ULL << target;
+        const bitmap rooks = pieces(Piece::ROOK) | pieces(Piece::QUEEN);
+        const bitmap bishops = pieces(Piece::BISHOP) | pieces(Piece::QUEEN);
+
+        return (pawn_attacks<Player::BLACK>(target_bit) & pieces(Player::WHITE, Piece::PAWN)) |
+               (pawn_attacks<Player::WHITE>(target_bit) & pieces(Player::BLACK, Piece::PAWN)) |
+               (knight_attacks(target) & pieces(Piece::KNIGHT)) |
+               (king_attacks(target) & pieces(Piece::KING)) |
+               (rook_attacks(target, occupancy_map) & rooks) |
+               (bishop_attacks(target, occupancy_map) & bishops);
+    }
+
+    bool GameState::is_square_attacked(const square target, const Player by) const {
+        return is_square_attacked(target, by, occupancy());
+    }
+
+    bool GameState::is_square_attacked(const square target, const Player by, const bitmap occupancy_map) const {
+        // Cheap lookups first, so that most queries never reach the sliding attack tables
+        const bitmap target_bit = 1ULL << target;
+        if (knight_attacks(target) & pieces(by, Piece::KNIGHT)) return true;
+        if (pawn_attacks(static_cast<Player>(by ^ 1), target_bit) & pieces(by, Piece::PAWN)) return true;
+        if (king_attacks(target) & pieces(by, Piece::KING)) return true;
+        if (rook_attacks(target, occupancy_map) & (pieces(by, Piece::ROOK) | pieces(by, Piece::QUEEN))) return true;
+        return (bishop_attacks(target, occupancy_map) & (pieces(by, Piece::BISHOP) | pieces(by, Piece::QUEEN))) != 0;
+    }
+
+    bitmap GameState::get_checkers() const {
+        const auto opponent = static_cast<Player>(to_move ^ 1);
+        return attackers_to(get_king_position(to_move), occupancy()) & occupancy(opponent);
+    }
+
+    bitmap GameState::get_king_blockers(const Player player) const {
+        const auto opponent = static_cast<Player>(player ^ 1);
+        const square king_position = get_king_position(player);
+        bitmap king_blockers = 0;
+
+        // Enemy sliders which would attack the king on an empty board
+        bitmap snipers = (rook_attacks(king_position, 0) &
+                          (pieces(opponent, Piece::ROOK) | pieces(opponent, Piece::QUEEN))) |
+                         (bishop_attacks(king_position, 0) &
+                          (pieces(opponent, Piece::BISHOP) | pieces(opponent, Piece::QUEEN)));
+
+        while (snipers > 0) {
+            const square sniper = pop_lsb(snipers);
+            const bitmap blockers = squares_between(king_position, sniper) & occupancy();
+
+            // A lone piece of either color is the only thing between the king and an attack
+            if (blockers > 0 && !more_than_one(blockers)) {
+                king_blockers |= blockers;
+            }
         }
 
-        const bitmap attack_map = get_attack_map(static_cast<Player>(to_move ^ 1));
-        const bitmap occupancy_map = get_occupancy_map();
+        return king_blockers;
+    }
+
+    bitmap GameState::get_pinned(const Player player) const {
+        // Blockers of the king's own color are pinned, those of the other color can give discovered check
+        return get_king_blockers(player) & occupancy(player);
+    }
+
+    void GameState::update_check_info() {
+        checking_pieces = get_checkers();
+        pinned_pieces[Player::WHITE] = get_pinned(Player::WHITE);
+        pinned_pieces[Player::BLACK] = get_pinned(Player::BLACK);
+    }
+
+    // Both castling checks assume that the king is not in check; the caller tests that once for both sides.
+    // Squares are given for White and mirrored onto the eighth rank for Black.
+    template<Player us>
+    bool GameState::king_side_castling_conditions_satisfied() const {
+        constexpr auto them = static_cast<Player>(us ^ 1);
+        constexpr int rank_offset = (us == Player::WHITE) ? 0 : 56;
+        constexpr bitmap in_between_squares = ((1ULL << 5) | (1ULL << 6)) << rank_offset;
 
-        if (passing_squares & attack_map) return false;
-        if (in_between_squares & occupancy_map) return false;
-        if (!can_castle_king_side[to_move]) return false;
-        return true;
+        if (!can_castle(us, KING_SIDE)) return false;
+        if (in_between_squares & occupancy()) return false;
+        return !is_square_attacked(5 + rank_offset, them) && !is_square_attacked(6 + rank_offset, them);
     }
 
+    template<Player us>
     bool GameState::queen_side_castling_conditions_satisfied() const {
-        bitmap in_between_squares, passing_squares;
-        if (to_move == Player::WHITE) {
-            in_between_squares = (1ULL << 1) | (1ULL << 2) | (1ULL << 3);
-            passing_squares = (1ULL << 2) | (1ULL << 3) | (1ULL << 4);
-        } else {
-            in_between_squares = (1ULL << 57) | (1ULL << 58) | (1ULL << 59);
-            passing_squares = (1ULL << 58) | (1ULL << 59) | (1ULL << 60);
-        }
+        constexpr auto them = static_cast<Player>(us ^ 1);
+        constexpr int rank_offset = (us == Player::WHITE) ? 0 : 56;
+        constexpr bitmap in_between_squares = ((1ULL << 1) | (1ULL << 2) | (1ULL << 3)) << rank_offset;
+
+        if (!can_castle(us, QUEEN_SIDE)) return false;
+        if (in_between_squares & occupancy()) return false;
+        return !is_square_attacked(3 + rank_offset, them) && !is_square_attacked(2 + rank_offset, them);
+    }
+
+    std::vector<Move> GameState::get_valid_moves() const {
+        MoveList valid_moves;
+        generate_legal(valid_moves);
+        return {valid_moves.begin(), valid_moves.end()};
+    }
 
-        const bitmap attack_map = get_attack_map(static_cast<Player>(to_move ^ 1));
-        const bitmap occupancy_map = get_occupancy_map();
+    void GameState::generate_legal(MoveList &valid_moves) const {
+        generate<GenType::LEGAL>(valid_moves);
+    }
+
+    template<GenType type>
+    void GameState::generate(MoveList &valid_moves) const {
+        assert(type != GenType::EVASIONS || checking_pieces > 0);
 
-        if (passing_squares & attack_map) return false;
-        if (in_between_squares & occupancy_map) return false;
-        if (!can_castle_queen_side[to_move]) return false;
-        return true;
+        // Color-dependent constants are folded into separate instantiations; this is the only branch on them
+        valid_moves.clear();
+        if (to_move == Player::WHITE) generate_moves<Player::WHITE, type>(valid_moves);
+        else generate_moves<Player::BLACK, type>(valid_moves);
     }
 
-    std::vector<std::unique_ptr<Move>> GameState::get_valid_moves() const {
-        std::vector<std::unique_ptr<Move>> valid_moves;
+    template<Player us, GenType type>
+    void GameState::generate_moves(MoveList &valid_moves) const {
+        constexpr auto them = static_cast<Player>(us ^ 1);
+        const square king_position = get_king_position(us);
+
+        // Everything needed to decide legality was computed when the position was reached. Pseudo-legal
+        // generation ignores pins and leaves them to is_legal.
+        const bitmap checkers = checking_pieces;
+        const bitmap pinned = (type == GenType::PSEUDO_LEGAL) ? 0 : pinned_pieces[us];
+
+        // Destinations allowed by the kind of move; pawns sort out promotions and en passant themselves
+        const bitmap type_mask = (type == GenType::CAPTURES) ? occupancy(them) :
+                                 (type == GenType::QUIETS || type == GenType::QUIET_CHECKS) ? ~occupancy() :
+                                 ~0ULL;
+
+        // Squares from which each piece type would check the enemy king, and our pieces whose departure from
+        // the line between that king and one of our sliders uncovers a check
+        bitmap check_squares[6] = {};
+        bitmap discovered_check_candidates = 0;
+        square enemy_king_position = INVALID_SQUARE;
+        if (type == GenType::QUIET_CHECKS) {
+            enemy_king_position = get_king_position(them);
+            check_squares[Piece::ROOK] = rook_attacks(enemy_king_position, occupancy());
+            check_squares[Piece::BISHOP] = bishop_attacks(enemy_king_position, occupancy());
+            check_squares[Piece::QUEEN] = check_squares[Piece::ROOK] | check_squares[Piece::BISHOP];
+            check_squares[Piece::KNIGHT] = knight_attacks(enemy_king_position);
+            discovered_check_candidates = get_king_blockers(them) & occupancy(us);
+        }
+
+        // King destinations are tested with the king lifted off the board, so that it cannot retreat along the
+        // ray of a checking slider. The king only ever gives a discovered check.
+        const bitmap occupancy_without_king = occupancy() ^ (1ULL << king_position);
+        bitmap king_targets = span_king(king_position, us) & type_mask;
+        if (type == GenType::QUIET_CHECKS) {
+            if (discovered_check_candidates & (1ULL << king_position)) {
+                king_targets &= ~line_through(enemy_king_position, king_position);
+            } else {
+                king_targets = 0;
+            }
+        }
+        for (bitmap candidates = king_targets; type != GenType::PSEUDO_LEGAL && candidates > 0;) {
+            const square finish = pop_lsb(candidates);
+            if (is_square_attacked(finish, them, occupancy_without_king)) king_targets ^= (1ULL << finish);
+        }
+        add_moves(king_position, king_targets, valid_moves);
 
-        // Check non-castling moves
-        for (int i = 0; i < 6; ++i) {
-            bitmap piece_locations = pieces[to_move][i];
+        // In double check only the king can move
+        if (more_than_one(checkers)) return;
+
+        // When in check, other pieces have to capture the checking piece or block its ray
+        bitmap target_mask = ~0ULL;
+        if (checkers > 0) {
+            target_mask = checkers | squares_between(king_position, lsb(checkers));
+        }
+
+        // Check non-castling moves of the remaining pieces except pawns
+        for (int i = Piece::QUEEN; i < Piece::PAWN; ++i) {
             const auto piece_type(static_cast<Piece>(i));
+            bitmap piece_locations = pieces(us, piece_type);
 
             while (piece_locations > 0) {
-                const square start = get_lowest_bit(piece_locations);
-                bitmap piece_span = span(start, to_move, piece_type);
-
-                while (piece_span > 0) {
-                    const square finish = get_lowest_bit(piece_span);
-
-                    // Check if the move promotes a pawn
-                    if (piece_type == Piece::PAWN && (finish < 8 || finish >= 56)) {
-                        for (const Piece promoted_piece: {Piece::QUEEN, Piece::ROOK, Piece::BISHOP, Piece::KNIGHT}) {
-                            std::unique_ptr<Move> promotion_move = std::make_unique<PromotionMove>(
-                                    start, finish, to_move, promoted_piece);
-
-                            if (!in_check_after_move(promotion_move)) {
-                                valid_moves.emplace_back(std::move(promotion_move));
-                            }
-                        }
-//                    Promotion queen_promotion(start, finish, to_move, Piece::QUEEN);
-//                    Promotion rook_promotion(start, finish, to_move, Piece::ROOK);
-//                    Promotion bishop_promotion(start, finish, to_move, Piece::BISHOP);
-//                    Promotion knight_promotion(start, finish, to_move, Piece::KNIGHT);
-//                    candidate_move.emplace_back(queen_promotion);
-//                    candidate_move.emplace_back(rook_promotion);
-//                    candidate_move.emplace_back(bishop_promotion);
-//                    candidate_move.emplace_back(knight_promotion);
-
-                    } else {
-                        // Also check if destination is occupied (by opposing piece)
-                        bool is_capture = is_occupied(finish);
-
-                        std::unique_ptr<Move> candidate_move = std::make_unique<NormalMove>(
-                                start, finish, piece_type, to_move, is_capture);
-                        if (!in_check_after_move(candidate_move)) {
-                            valid_moves.emplace_back(std::move(candidate_move));
-                        }
-                    }
+                const square start = pop_lsb(piece_locations);
+                bitmap piece_span = span(start, us, piece_type) & target_mask & type_mask;
 
-                    piece_span ^= finish;
+                // A pinned piece may only move along the line through its king and the pinning piece
+                if (pinned & (1ULL << start)) piece_span &= line_through(king_position, start);
+
+                if (type == GenType::QUIET_CHECKS) {
+                    bitmap checking_squares = check_squares[piece_type];
+                    if (discovered_check_candidates & (1ULL << start)) {
+                        checking_squares |= ~line_through(enemy_king_position, start);
+                    }
+                    piece_span &= checking_squares;
                 }
 
-                piece_locations ^= (1ULL << start);
+                add_moves(start, piece_span, valid_moves);
             }
         }
 
-        // Check castling
-        if (king_side_castling_conditions_satisfied()) {
-            std::unique_ptr<Move> castling_move = std::make_unique<CastlingMove>(
-                    CastlingVariant::KING_SIDE, to_move);
-            valid_moves.emplace_back(std::move(castling_move));
+        add_pawn_moves<us, type>(pinned, target_mask, valid_moves);
+
+        // Check castling, which is never possible out of check. It is always fully verified here.
+        if (type == GenType::QUIET_CHECKS || !generates_quiets(type)) return;
+
+        if (checkers == 0 && king_side_castling_conditions_satisfied<us>()) {
+            valid_moves.emplace_back(king_position, king_position + 2, MoveFlag::KING_SIDE_CASTLE);
+        }
+
+        if (checkers == 0 && queen_side_castling_conditions_satisfied<us>()) {
+            valid_moves.emplace_back(king_position, king_position - 2, MoveFlag::QUEEN_SIDE_CASTLE);
+        }
+    }
+
+    // The public entry point is instantiated here for every kind of move
+    template void GameState::generate<GenType::CAPTURES>(MoveList &) const;
+    template void GameState::generate<GenType::QUIETS>(MoveList &) const;
+    template void GameState::generate<GenType::EVASIONS>(MoveList &) const;
+    template void GameState::generate<GenType::QUIET_CHECKS>(MoveList &) const;
+    template void GameState::generate<GenType::LEGAL>(MoveList &) const;
+    template void GameState::generate<GenType::PSEUDO_LEGAL>(MoveList &) const;
+
+    int GameState::count_legal_moves() const {
+        if (to_move == Player::WHITE) return count_legal_moves<Player::WHITE>();
+        return count_legal_moves<Player::BLACK>();
+    }
+
+    // Mirrors generate_moves<us, LEGAL>, but adds up the sizes of the target sets instead of emitting moves
+    template<Player us>
+    int GameState::count_legal_moves() const {
+        constexpr auto them = static_cast<Player>(us ^ 1);
+        const square king_position = get_king_position(us);
+        const bitmap pinned = pinned_pieces[us];
+
+        const bitmap occupancy_without_king = occupancy() ^ (1ULL << king_position);
+        bitmap king_targets = span_king(king_position, us);
+        for (bitmap candidates = king_targets; candidates > 0;) {
+            const square finish = pop_lsb(candidates);
+            if (is_square_attacked(finish, them, occupancy_without_king)) king_targets ^= (1ULL << finish);
+        }
+        int count = popcount(king_targets);
+
+        if (more_than_one(checking_pieces)) return count;
+
+        bitmap target_mask = ~0ULL;
+        if (checking_pieces > 0) {
+            target_mask = checking_pieces | squares_between(king_position, lsb(checking_pieces));
+        }
+
+        for (int i = Piece::QUEEN; i < Piece::PAWN; ++i) {
+            const auto piece_type(static_cast<Piece>(i));
+            bitmap piece_locations = pieces(us, piece_type);
+
+            while (piece_locations > 0) {
+                const square start = pop_lsb(piece_locations);
+                bitmap piece_span = span(start, us, piece_type) & target_mask;
+                if (pinned & (1ULL << start)) piece_span &= line_through(king_position, start);
+                count += popcount(piece_span);
+            }
+        }
+
+        const bitmap pawns = pieces(us, Piece::PAWN);
+        count += count_pawn_set_moves<us>(pawns & ~pinned, target_mask);
+
+        bitmap pinned_pawns = pawns & pinned;
+        while (pinned_pawns > 0) {
+            const square start = pop_lsb(pinned_pawns);
+            count += count_pawn_set_moves<us>(1ULL << start, target_mask & line_through(king_position, start));
+        }
+
+        // En passant and castling are rare enough to be counted one move at a time
+        if (en_passant_square != INVALID_SQUARE) {
+            const square captured_square = en_passant_square + ((us == Player::WHITE) ? -8 : 8);
+            if (target_mask & ((1ULL << en_passant_square) | (1ULL << captured_square))) {
+                bitmap candidates = pawn_attacks<them>(1ULL << en_passant_square) & pawns;
+                while (candidates > 0) {
+                    if (!en_passant_exposes_king(pop_lsb(candidates))) ++count;
+                }
+            }
+        }
+
+        if (checking_pieces == 0) {
+            count += king_side_castling_conditions_satisfied<us>();
+            count += queen_side_castling_conditions_satisfied<us>();
+        }
+
+        return count;
+    }
+
+    template<Player us>
+    int GameState::count_pawn_set_moves(const bitmap pawns, const bitmap target_mask) const {
+        constexpr auto them = static_cast<Player>(us ^ 1);
+        const bitmap empty_squares = ~occupancy();
+        const bitmap capturable = occupancy(them);
+        constexpr int push_offset = (us == Player::WHITE) ? 8 : -8;
+        constexpr int left_capture_offset = (us == Player::WHITE) ? 7 : -9;
+        constexpr int right_capture_offset = (us == Player::WHITE) ? 9 : -7;
+        constexpr bitmap double_push_rank = (us == Player::WHITE) ? RANK_3 : RANK_6;
+        constexpr bitmap promotion_rank = (us == Player::WHITE) ? RANK_8 : RANK_1;
+
+        const bitmap single_pushes = shift(pawns, push_offset) & empty_squares;
+        const bitmap double_pushes = shift(single_pushes & double_push_rank, push_offset) & empty_squares;
+        const bitmap left_captures = shift(pawns & ~FILE_A, left_capture_offset) & capturable;
+        const bitmap right_captures = shift(pawns & ~FILE_H, right_capture_offset) & capturable;
+
+        // A pawn reaching the last rank yields one move per promoted piece. The two capture directions are
+        // counted separately, since two pawns may take on the same square.
+        int count = popcount(double_pushes & target_mask);
+        for (bitmap targets: {single_pushes, left_captures, right_captures}) {
+            targets &= target_mask;
+            count += popcount(targets & ~promotion_rank) + 4 * popcount(targets & promotion_rank);
+        }
+        return count;
+    }
+
+    bool GameState::is_legal(const Move move) const {
+        const square start = move.start(), finish = move.finish();
+        const square king_position = get_king_position(to_move);
+        assert(board[start] != NO_PIECE && owner_of(board[start]) == to_move);
+
+        // Castling is only generated when legal; the king may not step onto an attacked square
+        if (move.is_castling()) return true;
+        if (start == king_position) {
+            return !is_square_attacked(finish, static_cast<Player>(to_move ^ 1),
+                                       occupancy() ^ (1ULL << king_position));
+        }
+
+        if (move.is_en_passant()) return !en_passant_exposes_king(start);
+
+        // Any other piece must stay on the line of its pin, if it has one
+        return (pinned_pieces[to_move] & (1ULL << start)) == 0 ||
+               (line_through(king_position, start) & (1ULL << finish)) != 0;
+    }
+
+    bool GameState::is_pseudo_legal(const Move move) const {
+        const auto opponent = static_cast<Player>(to_move ^ 1);
+        const square start = move.start(), finish = move.finish();
+        const MoveFlag flag = move.flag();
+        const bitmap finish_bit = 1ULL << finish;
+
+        // The mover has to be ours and the destination must not be; flags 6 and 7 are unused
+        if (start == finish || flag == 6 || flag == 7) return false;
+        if (board[start] == NO_PIECE || owner_of(board[start]) != to_move) return false;
+        if (occupancy(to_move) & finish_bit) return false;
+
+        const Piece piece = type_of(board[start]);
+        const square king_position = get_king_position(to_move);
+
+        if (move.is_castling()) {
+            if (piece != Piece::KING || checking_pieces > 0) return false;
+            const bool king_side = (flag == MoveFlag::KING_SIDE_CASTLE);
+            if (finish != start + (king_side ? 2 : -2)) return false;
+            if (to_move == Player::WHITE) {
+                return start == 4 && (king_side ? king_side_castling_conditions_satisfied<Player::WHITE>()
+                                                : queen_side_castling_conditions_satisfied<Player::WHITE>());
+            }
+            return start == 60 && (king_side ? king_side_castling_conditions_satisfied<Player::BLACK>()
+                                             : queen_side_castling_conditions_satisfied<Player::BLACK>());
         }
 
-        if (queen_side_castling_conditions_satisfied()) {
-            std::unique_ptr<Move> castling_move = std::make_unique<CastlingMove>(
-                    CastlingVariant::QUEEN_SIDE, to_move);
-            valid_moves.emplace_back(std::move(castling_move));
+        // Apart from en passant, the capture flag has to agree with what stands on the destination
+        if (!move.is_en_passant() && move.is_capture() != ((occupancy(opponent) & finish_bit) != 0)) return false;
+
+        if (piece == Piece::PAWN) {
+            const int push_offset = (to_move == Player::WHITE) ? 8 : -8;
+            const bitmap promotion_rank = (to_move == Player::WHITE) ? RANK_8 : RANK_1;
+            if (move.is_promotion() != ((promotion_rank & finish_bit) != 0)) return false;
+
+            if (flag == MoveFlag::DOUBLE_PAWN_PUSH) {
+                const bitmap double_push_rank = (to_move == Player::WHITE) ? RANK_3 : RANK_6;
+                const square passed_square = start + push_offset;
+                if (finish != passed_square + push_offset || (double_push_rank & (1ULL << passed_square)) == 0 ||
+                    (occupancy() & ((1ULL << passed_square) | finish_bit))) {
+                    return false;
+                }
+            } else if (move.is_en_passant()) {
+                if (finish != en_passant_square) return false;
+            } else if (!move.is_capture()) {
+                if (finish != start + push_offset || (occupancy() & finish_bit)) return false;
+            }
+            if (move.is_capture() && (pawn_attacks(to_move, 1ULL << start) & finish_bit) == 0) return false;
+        } else {
+            if (flag != MoveFlag::QUIET && flag != MoveFlag::CAPTURE) return false;
+            if ((span(start, to_move, piece) & finish_bit) == 0) return false;
         }
 
-        return valid_moves;
+        // Out of check everything else is left to is_legal. In check, the king may still step anywhere, while
+        // other pieces have to capture the lone checker or block its ray.
+        if (checking_pieces == 0 || piece == Piece::KING) return true;
+        if (more_than_one(checking_pieces)) return false;
+
+        const bitmap target_mask = checking_pieces | squares_between(king_position, lsb(checking_pieces));
+        if (move.is_en_passant() && (target_mask & (1ULL << get_captured_square(move)))) return true;
+        return (target_mask & finish_bit) != 0;
+    }
+
+    void GameState::add_moves(const square start, bitmap targets,
+                              MoveList &valid_moves) const {
+        while (targets > 0) {
+            const square finish = pop_lsb(targets);
+
+            // Also check if destination is occupied (by opposing piece)
+            const MoveFlag flag = is_occupied(finish) ? MoveFlag::CAPTURE : MoveFlag::QUIET;
+            valid_moves.emplace_back(start, finish, flag);
+        }
     }
 
     bitmap GameState::span(const square start, const Player player, const Piece piece_type) const {
-        assert(pieces[to_move][piece_type] & (1ULL << start));
+        assert(pieces(to_move, piece_type) & (1ULL << start));
         if (piece_type == Piece::KING) return span_king(start, player);
         if (piece_type == Piece::QUEEN) return span_queen(start, player);
         if (piece_type == Piece::ROOK) return span_rook(start, player);
         if (piece_type == Piece::BISHOP) return span_bishop(start, player);
         if (piece_type == Piece::KNIGHT) return span_knight(start, player);
-        if (piece_type == Piece::PAWN) return span_pawn(start, player);
         throw std::runtime_error("Something went horribly wrong. None of the valid pieces selected.");
     }
 
-    bitmap GameState::span_pawn(const square start, const Player player) const {
-        assert(pieces[player][Piece::PAWN] & (1ULL << start));
-        bitmap span_mask = 0;
-        square finish;
-        int direction_modifier = (player == Player::WHITE) ? 1 : -1;
+    template<Player us, GenType type>
+    void GameState::add_pawn_moves(const bitmap pinned, const bitmap target_mask, MoveList &valid_moves) const {
+        constexpr auto them = static_cast<Player>(us ^ 1);
+        const square king_position = get_king_position(us);
+        const bitmap pawns = pieces(us, Piece::PAWN);
+
+        // A push gives check by landing next to the enemy king, or by uncovering one of our sliders. Pushes
+        // along the king's file keep blocking it.
+        bitmap discovering_pawns = 0;
+        bitmap direct_check_mask = ~0ULL;
+        if (type == GenType::QUIET_CHECKS) {
+            const square enemy_king_position = get_king_position(them);
+            discovering_pawns = get_king_blockers(them) & pawns & ~(FILE_A << (enemy_king_position & 7));
+            direct_check_mask = pawn_attacks<them>(1ULL << enemy_king_position);
+        }
 
-        // Normal pawn forward
-        bool can_move_forward = false;
-        finish = start + direction_modifier * 8;
-        if (!is_occupied(finish)) {
-            span_mask |= finish;
-            can_move_forward = true;
+        // Unpinned pawns are handled all at once, pinned ones (rare) one at a time along their pin line
+        const bitmap unpinned_pawns = pawns & ~pinned;
+        add_pawn_set_moves<us, type>(unpinned_pawns & ~discovering_pawns, target_mask & direct_check_mask,
+                                     valid_moves);
+        if (discovering_pawns > 0) {
+            add_pawn_set_moves<us, type>(unpinned_pawns & discovering_pawns, target_mask, valid_moves);
         }
 
-        // Pawn captures
-        const int direction_offset[] = {7, 9};
-        for (const auto &offset: direction_offset) {
-            finish = start + direction_modifier * offset;
-            if (is_occupied(finish) && square_ownership(finish) != player || finish == en_passant_square)
-                span_mask |= finish;
+        bitmap pinned_pawns = pawns & pinned;
+        while (pinned_pawns > 0) {
+            const square start = pop_lsb(pinned_pawns);
+            const bitmap pin_mask = target_mask & line_through(king_position, start);
+            const bitmap check_mask = (discovering_pawns & (1ULL << start)) ? ~0ULL : direct_check_mask;
+            add_pawn_set_moves<us, type>(1ULL << start, pin_mask & check_mask, valid_moves);
         }
 
-        // Moving forward two squares if pawn is on back rank
-        if ((player == Player::WHITE && start >= 8 && start < 16) ||
-            (player == Player::BLACK && start >= 48 && start < 56)) {
-            finish = start + direction_modifier * 16;
-            if (can_move_forward && !is_occupied(finish)) {
-                span_mask |= finish;
-            }
+        if (generates_captures(type)) {
+            add_en_passant_moves<us, type>(target_mask, valid_moves);
         }
+    }
 
-        return span_mask;
+    template<Player us, GenType type>
+    void GameState::add_pawn_set_moves(const bitmap pawns, const bitmap target_mask, MoveList &valid_moves) const {
+        constexpr auto them = static_cast<Player>(us ^ 1);
+        const bitmap empty_squares = ~occupancy();
+        const bitmap capturable = occupancy(them);
+
+        // Offsets are relative to the start square; captures are named after the direction seen from White
+        constexpr int push_offset = (us == Player::WHITE) ? 8 : -8;
+        constexpr int left_capture_offset = (us == Player::WHITE) ? 7 : -9;
+        constexpr int right_capture_offset = (us == Player::WHITE) ? 9 : -7;
+        constexpr bitmap double_push_rank = (us == Player::WHITE) ? RANK_3 : RANK_6;
+        constexpr bitmap promotion_rank = (us == Player::WHITE) ? RANK_8 : RANK_1;
+
+        // Promotions count as captures, so quiet moves never reach the last rank
+        bitmap push_mask = target_mask;
+        if (type == GenType::CAPTURES) push_mask &= promotion_rank;
+        if (type == GenType::QUIETS || type == GenType::QUIET_CHECKS) push_mask &= ~promotion_rank;
+
+        const bitmap single_pushes = shift(pawns, push_offset) & empty_squares;
+        add_pawn_targets(single_pushes & push_mask, push_offset, MoveFlag::QUIET, valid_moves);
+
+        if (generates_quiets(type)) {
+            const bitmap double_pushes = shift(single_pushes & double_push_rank, push_offset) & empty_squares;
+            add_pawn_targets(double_pushes & target_mask, 2 * push_offset, MoveFlag::DOUBLE_PAWN_PUSH, valid_moves);
+        }
+
+        if (generates_captures(type)) {
+            const bitmap left_captures = shift(pawns & ~FILE_A, left_capture_offset) & capturable;
+            const bitmap right_captures = shift(pawns & ~FILE_H, right_capture_offset) & capturable;
+            add_pawn_targets(left_captures & target_mask, left_capture_offset, MoveFlag::CAPTURE, valid_moves);
+            add_pawn_targets(right_captures & target_mask, right_capture_offset, MoveFlag::CAPTURE, valid_moves);
+        }
     }
 
-    bitmap GameState::span_jumping(const square start, const Player player, const int *direction_offset,
-                                   const Piece piece_type) const {
-        assert(pieces[player][piece_type] & (1ULL << start));
-        bitmap span_mask = 0;
+    template<Player us, GenType type>
+    void GameState::add_en_passant_moves(const bitmap target_mask, MoveList &valid_moves) const {
+        if (en_passant_square == INVALID_SQUARE) return;
 
-        for (int i = 0; i < 8; ++i) {
-            square current = start + direction_offset[i];
-            if (current >= 0 && current <= 63 && (!is_occupied(current) || square_ownership(current) != player)) {
-                span_mask |= (1ULL << current);
+        constexpr auto them = static_cast<Player>(us ^ 1);
+        const square captured_square = en_passant_square + ((us == Player::WHITE) ? -8 : 8);
+
+        // When in check, the capture has to either take the checking pawn or block on the en passant square
+        if ((target_mask & ((1ULL << en_passant_square) | (1ULL << captured_square))) == 0) return;
+
+        bitmap candidates = pawn_attacks<them>(1ULL << en_passant_square) & pieces(us, Piece::PAWN);
+        while (candidates > 0) {
+            const square start = pop_lsb(candidates);
+            if (type == GenType::PSEUDO_LEGAL || !en_passant_exposes_king(start)) {
+                valid_moves.emplace_back(start, en_passant_square, MoveFlag::EN_PASSANT);
             }
         }
-
-        return span_mask;
     }
 
-    bitmap GameState::span_king(const square start, const Player player) const {
-        const int direction_offset[] = {-1, 7, 8, 9, 1, -7, -8, -9};
-        return span_jumping(start, player, direction_offset, Piece::KING);
+    bool GameState::en_passant_exposes_king(const square start) const {
+        const auto opponent = static_cast<Player>(to_move ^ 1);
+        const square king_position = get_king_position(to_move);
+        const square captured_square = (start & ~7) | (en_passant_square & 7);
+        const bitmap rooks = pieces(opponent, Piece::ROOK) | pieces(opponent, Piece::QUEEN);
+        const bitmap bishops = pieces(opponent, Piece::BISHOP) | pieces(opponent, Piece::QUEEN);
+
+        // Two pawns leave the same rank at once, which pin masks cannot describe (e.g. king and rook on the
+        // fifth rank), so the sliders are checked against the occupancy after the capture directly
+        const bitmap occupancy_map =
+                (occupancy() ^ (1ULL << start) ^ (1ULL << captured_square)) | (1ULL << en_passant_square);
+        return (rook_attacks(king_position, occupancy_map) & rooks) != 0 ||
+               (bishop_attacks(king_position, occupancy_map) & bishops) != 0;
     }
 
-    bitmap GameState::span_knight(const square start, const Player player) const {
-        const int direction_offset[] = {6, 15, 17, 10, -6, -15, -17, -10};
-        return span_jumping(start, player, direction_offset, Piece::KNIGHT);
-    }
-
-    bitmap GameState::span_sliding(const square start, const Player player, const int *direction_offset,
-                                   const Piece piece_type) const {
-        assert(pieces[player][piece_type] & (1ULL << start));
-        bitmap span_mask = 0;
-        const int num_directions = (piece_type == Piece::QUEEN) ? 8 : 4;
-
-        for (int i = 0; i < num_directions; ++i) {
-            square current = start;
-            while (true) {
-                current = current + direction_offset[i];
-                if (current < 0 || current > 63) break;
-                if (is_occupied(current)) {
-                    if (square_ownership(current) != player) span_mask |= (1ULL << current);
-                    break;
+    void GameState::add_pawn_targets(bitmap targets, const int offset, const MoveFlag flag,
+                                     MoveList &valid_moves) const {
+        while (targets > 0) {
+            const square finish = pop_lsb(targets);
+            const square start = finish - offset;
+
+            // Check if the move promotes a pawn
+            if ((1ULL << finish) & (RANK_1 | RANK_8)) {
+                for (const Piece promoted_piece: {Piece::QUEEN, Piece::ROOK, Piece::BISHOP, Piece::KNIGHT}) {
+                    valid_moves.push_back(Move::promotion(start, finish, promoted_piece, flag == MoveFlag::CAPTURE));
                 }
+            } else {
+                valid_moves.emplace_back(start, finish, flag);
             }
         }
+    }
 
-        return span_mask;
+    bitmap GameState::span_king(const square start, const Player player) const {
+        assert(pieces(player, Piece::KING) & (1ULL << start));
+        return king_attacks(start) & ~occupancy(player);
+    }
+
+    bitmap GameState::span_knight(const square start, const Player player) const {
+        assert(pieces(player, Piece::KNIGHT) & (1ULL << start));
+        return knight_attacks(start) & ~occupancy(player);
     }
 
     bitmap GameState::span_queen(const square start, const Player player) const {
-        const int direction_offset[] = {-1, 7, 8, 9, 1, -7, -8, -9};
-        return span_sliding(start, player, direction_offset, Piece::QUEEN);
+        assert(pieces(player, Piece::QUEEN) & (1ULL << start));
+        return queen_attacks(start, occupancy()) & ~occupancy(player);
     }
 
     bitmap GameState::span_rook(const square start, const Player player) const {
-        const int direction_offset[] = {-1, 8, 1, -8};
-        return span_sliding(start, player, direction_offset, Piece::ROOK);
+        assert(pieces(player, Piece::ROOK) & (1ULL << start));
+        return rook_attacks(start, occupancy()) & ~occupancy(player);
     }
 
     bitmap GameState::span_bishop(const square start, const Player player) const {
-        const int direction_offset[] = {7, 9, -7, -9};
-        return span_sliding(start, player, direction_offset, Piece::BISHOP);
+        assert(pieces(player, Piece::BISHOP) & (1ULL << start));
+        return bishop_attacks(start, occupancy()) & ~occupancy(player);
     }
 
-    bitmap GameState::attacking(const square start, const Player player, const Piece piece) const {
-        // For all non-pawn pieces, the span and the attacked squares are the same
-        if (piece != Piece::PAWN) return span(start, player, piece);
-        return attacking_pawn(start, player);
+    bitmap GameState::attacking(const square start, const Player player, const Piece piece,
+                                const bitmap occupancy_map) const {
+        // Unlike the span, the attacked squares include those occupied by the attacker's own pieces
+        assert(pieces(player, piece) & (1ULL << start));
+        if (piece == Piece::KING) return king_attacks(start);
+        if (piece == Piece::QUEEN) return queen_attacks(start, occupancy_map);
+        if (piece == Piece::ROOK) return rook_attacks(start, occupancy_map);
+        if (piece == Piece::BISHOP) return bishop_attacks(start, occupancy_map);
+        if (piece == Piece::KNIGHT) return knight_attacks(start);
+        if (piece == Piece::PAWN) return attacking_pawn(start, player);
+        throw std::runtime_error("Something went horribly wrong. None of the valid pieces selected.");
     }
 
     bitmap GameState::attacking_pawn(const square start, const Player player) const {
-        assert(pieces[player][Piece::PAWN] & (1ULL << start));
-        int direction_modifier = (player == Player::WHITE) ? 1 : -1;
-        return (1ULL << (start + direction_modifier * 7)) | (1ULL << (start + direction_modifier * 9));
+        assert(pieces(player, Piece::PAWN) & (1ULL << start));
+        return pawn_attacks(player, 1ULL << start);
     }
 
     bool GameState::is_check() const {
-        bitmap attack_map = get_attack_map(static_cast<Player>(to_move ^ 1));
-        const bitmap king_position = get_king_position(to_move);
-        return attack_map & (1ULL << king_position);
+        return checking_pieces != 0;
     }
 
     bool GameState::is_checkmate() const {
@@ -342,139 +763,296 @@ namespace chess {
         return !is_check() && no_valid_moves();
     }
 
-    // NOTE: Should be optimized
     bool GameState::no_valid_moves() const {
-        return !get_valid_moves().empty();
+        return !has_any_legal_move();
     }
 
-    bool GameState::is_occupied(const square query) const {
-        for (int i = 0; i < 6; ++i) {
-            if (pieces[Player::WHITE][i] & (1ULL << query))
-                return true;
-            if (pieces[Player::BLACK][i] & (1ULL << query))
-                return true;
+    GameStatus GameState::game_status() const {
+        const bool in_check = is_check();
+        if (!has_any_legal_move()) return in_check ? GameStatus::CHECKMATE : GameStatus::STALEMATE;
+        if (half_move_counter >= 100) return GameStatus::FIFTY_MOVE_DRAW;
+        if (is_insufficient_material()) return GameStatus::INSUFFICIENT_MATERIAL_DRAW;
+        return in_check ? GameStatus::IN_CHECK : GameStatus::ONGOING;
+    }
+
+    GameStatus GameState::game_status(const std::vector<zobrist_key> &history) const {
+        const GameStatus status = game_status();
+        if (status != GameStatus::ONGOING && status != GameStatus::IN_CHECK) return status;
+        return is_repetition(history) ? GameStatus::REPETITION_DRAW : status;
+    }
+
+    bool GameState::is_repetition(const std::vector<zobrist_key> &history, const int search_ply) const {
+        // A capture or pawn move can never be undone, so nothing older than the halfmove counter can repeat.
+        // Positions with the same side to move are two plies apart, and a repetition takes at least four.
+        const int distance_limit = std::min(static_cast<int>(half_move_counter), static_cast<int>(history.size()));
+        bool repeated_before = false;
+
+        for (int distance = 4; distance <= distance_limit; distance += 2) {
+            if (history[history.size() - distance] != key) continue;
+            if (distance < search_ply || repeated_before) return true;
+            repeated_before = true;
         }
+
         return false;
     }
 
-    /*****************************
-     * Move member functions
-     *****************************/
-    GameState NormalMove::transform(const GameState &state) const {
-        // Flip turn player
-        const auto to_move = static_cast<Player>(state.to_move ^ 1);
+    bool GameState::is_insufficient_material() const {
+        if (pieces(Piece::PAWN) | pieces(Piece::ROOK) | pieces(Piece::QUEEN)) return false;
 
-        // Update bitboards
-        bitmap pieces[2][6];
-        std::copy(&state.pieces[0][0], &state.pieces[0][0] + 12, &pieces[0][0]);
-        if (is_capture) {
-            for (int i = 0; i < 6; ++i) {
-                pieces[state.to_move ^ 1][i] &= (~(1ULL << finish));
+        const bitmap minor_pieces = pieces(Piece::KNIGHT) | pieces(Piece::BISHOP);
+        if (!more_than_one(minor_pieces)) return true;
+
+        // Any number of bishops cannot mate if they all run on the same color
+        const bitmap light_squares = 0x55aa55aa55aa55aaULL;
+        return pieces(Piece::KNIGHT) == 0 &&
+               ((pieces(Piece::BISHOP) & light_squares) == 0 || (pieces(Piece::BISHOP) & ~light_squares) == 0);
+    }
+
+    bool GameState::is_draw(const std::vector<zobrist_key> &history, const int search_ply) const {
+        if (half_move_counter >= 100 && (!is_check() || has_any_legal_move())) return true;
+        return is_insufficient_material() || is_repetition(history, search_ply);
+    }
+
+    bool GameState::has_any_legal_move() const {
+        if (to_move == Player::WHITE) return has_any_legal_move<Player::WHITE>();
+        return has_any_legal_move<Player::BLACK>();
+    }
+
+    template<Player us>
+    bool GameState::has_any_legal_move() const {
+        constexpr auto them = static_cast<Player>(us ^ 1);
+        const square king_position = get_king_position(us);
+
+        // King moves first: they are the only option in double check and usually exist otherwise
+        const bitmap occupancy_without_king = occupancy() ^ (1ULL << king_position);
+        bitmap king_targets = span_king(king_position, us);
+        while (king_targets > 0) {
+            if (!is_square_attacked(pop_lsb(king_targets), them, occupancy_without_king)) return true;
+        }
+
+        if (more_than_one(checking_pieces)) return false;
+
+        bitmap target_mask = ~0ULL;
+        if (checking_pieces > 0) {
+            target_mask = checking_pieces | squares_between(king_position, lsb(checking_pieces));
+        }
+
+        for (int i = Piece::QUEEN; i < Piece::PAWN; ++i) {
+            const auto piece_type(static_cast<Piece>(i));
+            bitmap piece_locations = pieces(us, piece_type);
+
+            while (piece_locations > 0) {
+                const square start = pop_lsb(piece_locations);
+                bitmap piece_span = span(start, us, piece_type) & target_mask;
+                if (pinned_pieces[us] & (1ULL << start)) piece_span &= line_through(king_position, start);
+                if (piece_span > 0) return true;
             }
         }
-        pieces[state.to_move][piece] ^= (1ULL << start);
-        pieces[state.to_move][piece] |= (1ULL << finish);
 
-        // Update fifty-move rule counter
-        int half_move_counter;
-        if (is_capture || piece == Piece::PAWN)
-            half_move_counter = 0;
-        else
-            half_move_counter = state.half_move_counter + 1;
+        // Castling is never needed: if it is legal, so is the king's step onto the passing square
+        MoveList pawn_moves;
+        add_pawn_moves<us, GenType::LEGAL>(pinned_pieces[us], target_mask, pawn_moves);
+        return !pawn_moves.empty();
+    }
 
-        // Update castling permissions
-        bool can_castle_king_side[2], can_castle_queen_side[2];
-        std::copy(state.can_castle_king_side, state.can_castle_king_side + 2, can_castle_king_side);
-        std::copy(state.can_castle_queen_side, state.can_castle_queen_side + 2, can_castle_queen_side);
-        const square king_side_rook_square = (state.to_move == Player::WHITE) ? 7 : 63;
-        const square queen_side_rook_square = (state.to_move == Player::WHITE) ? 0 : 56;
+    bool GameState::is_occupied(const square query) const {
+        return board[query] != NO_PIECE;
+    }
 
-        if ((pieces[state.to_move][Piece::ROOK] & (1ULL << king_side_rook_square)) == 0) {
-            can_castle_king_side[state.to_move] = false;
+    /*****************************
+     * Move application
+     *****************************/
+    void GameState::make_move(const Move move, Undo &undo) {
+        if (to_move == Player::WHITE) make_move<Player::WHITE>(move, undo);
+        else make_move<Player::BLACK>(move, undo);
+    }
+
+    void GameState::make_move(const Move move, Undo &undo, const TranspositionTable &table) {
+        const zobrist_key next_key = key_after(move);
+        table.prefetch(next_key);
+        make_move(move, undo);
+        assert(key == next_key);
+        (void) next_key;
+    }
+
+    zobrist_key GameState::key_after(const Move move) const {
+        const auto opponent = static_cast<Player>(to_move ^ 1);
+        const square start = move.start(), finish = move.finish();
+        const colored_piece piece = board[start];
+        const colored_piece placed_piece = move.is_promotion() ? make_piece(to_move, move.promoted_piece()) : piece;
+        zobrist_key next_key = key ^ zobrist::black_to_move ^ zobrist::piece_square[piece][start] ^
+                               zobrist::piece_square[placed_piece][finish];
+
+        if (move.is_capture()) {
+            const square captured_square = get_captured_square(move);
+            next_key ^= zobrist::piece_square[board[captured_square]][captured_square];
         }
-        if ((pieces[state.to_move][Piece::ROOK] & (1ULL << queen_side_rook_square)) == 0) {
-            can_castle_queen_side[state.to_move] = false;
+
+        if (move.is_castling()) {
+            const colored_piece rook = make_piece(to_move, Piece::ROOK);
+            const bool king_side = (move.flag() == MoveFlag::KING_SIDE_CASTLE);
+            next_key ^= zobrist::piece_square[rook][king_side ? start + 3 : start - 4] ^
+                        zobrist::piece_square[rook][king_side ? start + 1 : start - 1];
         }
 
-        // Check is en passant condition is met
-        square en_passant_square = INVALID_SQUARE;
-        if (piece == Piece::PAWN) {
-            int travel_distance = std::abs(finish - start);
-            if (travel_distance == 16) {
-                en_passant_square = std::min(start, finish) + 8;
-            }
+        const std::uint8_t next_castling_rights =
+                castling_rights & ~(castling_rights_lost(start) | castling_rights_lost(finish));
+        next_key ^= zobrist::castling[castling_rights] ^ zobrist::castling[next_castling_rights];
+
+        // Mirrors make_move: a new en passant square only counts if an enemy pawn can capture there
+        if (en_passant_square != INVALID_SQUARE) next_key ^= zobrist::en_passant_file[en_passant_square & 7];
+        if (move.flag() == MoveFlag::DOUBLE_PAWN_PUSH &&
+            (pawn_attacks(to_move, 1ULL << ((start + finish) / 2)) & pieces(opponent, Piece::PAWN))) {
+            next_key ^= zobrist::en_passant_file[finish & 7];
         }
 
-        return {to_move, (const bitmap **) pieces, half_move_counter, can_castle_king_side, can_castle_queen_side,
-                en_passant_square};
+        return next_key;
     }
 
-    GameState PromotionMove::transform(const GameState &state) const {
-        assert(piece == Piece::PAWN);
+    void GameState::unmake_move(const Move move, const Undo &undo) {
+        // The side which made the move is the one not to move now
+        if (to_move == Player::BLACK) unmake_move<Player::WHITE>(move, undo);
+        else unmake_move<Player::BLACK>(move, undo);
+    }
 
-        // Flip turn player
-        auto to_move = static_cast<Player>(state.to_move ^ 1);
+    template<Player player>
+    void GameState::make_move(const Move move, Undo &undo) {
+        constexpr auto opponent = static_cast<Player>(player ^ 1);
+        const square start = move.start(), finish = move.finish();
+        const Piece piece = get_piece_type(player, start);
+
+        // Remember everything the move itself cannot tell
+        undo.key = key;
+        undo.castling_rights = castling_rights;
+        undo.en_passant_square = en_passant_square;
+        undo.half_move_counter = half_move_counter;
+        undo.checkers = checking_pieces;
+        std::copy(pinned_pieces, pinned_pieces + 2, undo.pinned);
 
         // Update bitboards
-        bitmap pieces[2][6];
-        std::copy(&state.pieces[0][0], &state.pieces[0][0] + 12, &pieces[0][0]);
-        pieces[state.to_move][Piece::PAWN] ^= (1ULL << start);
-        pieces[state.to_move][promoted_piece] |= (1ULL << finish);
+        if (move.is_capture()) {
+            const square captured_square = get_captured_square(move);
+            undo.captured_piece = get_piece_type(opponent, captured_square);
+            remove_piece(opponent, undo.captured_piece, captured_square);
+        }
+        remove_piece(player, piece, start);
+        put_piece(player, move.is_promotion() ? move.promoted_piece() : piece, finish);
 
-        return {to_move, (const bitmap **) pieces, 0, state.can_castle_king_side,
-                state.can_castle_queen_side, INVALID_SQUARE};
-    }
+        // The king's part of castling is an ordinary move, the rook jumps over it
+        if (move.is_castling()) {
+            assert(piece == Piece::KING);
+            move_castling_rook(move, player);
+        }
+
+        // Update fifty-move rule counter
+        if (move.is_capture() || piece == Piece::PAWN)
+            half_move_counter = 0;
+        else if (half_move_counter < 255)
+            ++half_move_counter;
+
+        // Pieces were hashed by put_piece and remove_piece; the rest of the key changes here
+        key ^= zobrist::castling[castling_rights];
+        castling_rights &= ~(castling_rights_lost(start) | castling_rights_lost(finish));
+        key ^= zobrist::castling[castling_rights];
+
+        // Check is en passant condition is met. The square is only kept if an enemy pawn can capture there, so
+        // that positions which only differ by an unusable en passant square hash the same.
+        if (en_passant_square != INVALID_SQUARE) key ^= zobrist::en_passant_file[en_passant_square & 7];
+        en_passant_square = INVALID_SQUARE;
+        if (move.flag() == MoveFlag::DOUBLE_PAWN_PUSH) {
+            const square passed_square = (start + finish) / 2;
+            if (pawn_attacks<player>(1ULL << passed_square) & pieces(opponent, Piece::PAWN)) {
+                en_passant_square = static_cast<std::int8_t>(passed_square);
+                key ^= zobrist::en_passant_file[passed_square & 7];
+            }
+        }
 
-    GameState CastlingMove::transform(const GameState &state) const {
         // Flip turn player
-        auto to_move = static_cast<Player>(state.to_move ^ 1);
+        to_move = opponent;
+        key ^= zobrist::black_to_move;
+        assert(key == compute_key());
+        update_check_info();
+    }
 
-        // Update bitboards
-        bitmap pieces[2][6];
-        std::copy(&state.pieces[0][0], &state.pieces[0][0] + 12, &pieces[0][0]);
+    template<Player player>
+    void GameState::unmake_move(const Move move, const Undo &undo) {
+        constexpr auto opponent = static_cast<Player>(player ^ 1);
+        const square start = move.start(), finish = move.finish();
+        const Piece piece = get_piece_type(player, finish);
 
-        const square king_square = (state.to_move == Player::WHITE) ? 4 : 60;
-        square rook_square, new_king_square, new_rook_square;
+        // Undo bitboard changes in reverse order
+        if (move.is_castling()) {
+            move_castling_rook(move, player);
+        }
+        remove_piece(player, piece, finish);
+        put_piece(player, move.is_promotion() ? Piece::PAWN : piece, start);
+        if (move.is_capture()) {
+            put_piece(opponent, undo.captured_piece, get_captured_square(move));
+        }
 
-        if (variant == CastlingVariant::KING_SIDE) {
-            assert(state.can_castle_king_side[state.to_move]);
-            rook_square = (state.to_move == Player::WHITE) ? 7 : 63;
-            new_king_square = king_square + 2;
-            new_rook_square = rook_square - 2;
+        key = undo.key;
+        castling_rights = undo.castling_rights;
+        en_passant_square = undo.en_passant_square;
+        half_move_counter = undo.half_move_counter;
+        checking_pieces = undo.checkers;
+        std::copy(undo.pinned, undo.pinned + 2, pinned_pieces);
+        to_move = player;
+        assert(key == compute_key());
+    }
+
+    square GameState::get_captured_square(const Move move) {
+        // An en passant capture takes the pawn which is one rank behind the destination
+        if (move.is_en_passant()) return (move.start() & ~7) | (move.finish() & 7);
+        return move.finish();
+    }
+
+    void GameState::move_castling_rook(const Move move, const Player player) {
+        // Moving the rook back and forth is the same operation
+        const square king_square = move.start();
+        square rook_square, new_rook_square;
+        if (move.flag() == MoveFlag::KING_SIDE_CASTLE) {
+            rook_square = king_square + 3;
+            new_rook_square = king_square + 1;
         } else {
-            assert(state.can_castle_queen_side[state.to_move]);
-            rook_square = (state.to_move == Player::WHITE) ? 0 : 56;
-            new_king_square = king_square - 2;
-            new_rook_square = rook_square + 3;
+            rook_square = king_square - 4;
+            new_rook_square = king_square - 1;
         }
 
-        pieces[state.to_move][Piece::KING] ^= (1ULL << king_square);
-        pieces[state.to_move][Piece::KING] |= (1ULL << new_king_square);
-        pieces[state.to_move][Piece::ROOK] ^= (1ULL << rook_square);
-        pieces[state.to_move][Piece::ROOK] |= (1ULL << new_rook_square);
+        const bitmap rook_squares = (1ULL << rook_square) | (1ULL << new_rook_square);
+        by_type[Piece::ROOK] ^= rook_squares;
+        by_color[player] ^= rook_squares;
+        key ^= zobrist::piece_square[make_piece(player, Piece::ROOK)][rook_square] ^
+               zobrist::piece_square[make_piece(player, Piece::ROOK)][new_rook_square];
+        std::swap(board[rook_square], board[new_rook_square]);
+    }
 
-        // Update fifty-move rule counter
-        int half_move_counter = state.half_move_counter + 1;
+    void GameState::put_piece(const Player player, const Piece piece, const square location) {
+        const bitmap location_mask = 1ULL << location;
+        by_type[piece] |= location_mask;
+        by_color[player] |= location_mask;
+        key ^= zobrist::piece_square[make_piece(player, piece)][location];
+        board[location] = make_piece(player, piece);
+    }
 
-        // Update castling permissions
-        bool can_castle_king_side[2], can_castle_queen_side[2];
-        std::copy(state.can_castle_king_side, state.can_castle_king_side + 2, can_castle_king_side);
-        std::copy(state.can_castle_queen_side, state.can_castle_queen_side + 2, can_castle_queen_side);
-        can_castle_king_side[state.to_move] = false;
-        can_castle_queen_side[state.to_move] = false;
+    void GameState::remove_piece(const Player player, const Piece piece, const square location) {
+        const bitmap location_mask = 1ULL << location;
+        by_type[piece] ^= location_mask;
+        by_color[player] ^= location_mask;
+        key ^= zobrist::piece_square[make_piece(player, piece)][location];
+        board[location] = NO_PIECE;
+    }
 
-        return {to_move, (const bitmap **) pieces, half_move_counter, can_castle_king_side, can_castle_queen_side,
-                INVALID_SQUARE};
+    GameState apply_move(const GameState &state, const Move move) {
+        GameState new_state(state);
+        Undo undo;
+        new_state.make_move(move, undo);
+        return new_state;
     }
 
     Player GameState::square_ownership(square query) const {
-        for (int i = 0; i < 6; ++i) {
-            if (pieces[Player::WHITE][i] & (1ULL << query))
-                return Player::WHITE;
-            if (pieces[Player::BLACK][i] & (1ULL << query))
-                return Player::BLACK;
-        }
-        throw std::logic_error("Square is not owned by either player");
+        if (board[query] == NO_PIECE)
+            throw std::logic_error("Square is not owned by either player");
+        return owner_of(board[query]);
     }
 
 }
\ No newline at end of file
@@ -3,97 +3,203 @@
 
 #include <vector>
 #include <string>
-#include <memory>
+#include <cstdint>
+#include <cassert>
+#include <type_traits>
+#include "bitops.h"
+#include "zobrist.h"
 
 namespace chess {
-    typedef unsigned long long bitmap;
-    typedef int square;
     const square INVALID_SQUARE = -1;
 
-    enum Player {
+    enum Player : std::uint8_t {
         WHITE = 0, BLACK = 1
     };
-    enum Piece {
+    enum Piece : std::uint8_t {
         KING = 0, QUEEN = 1, ROOK = 2, BISHOP = 3, KNIGHT = 4, PAWN = 5
     };
     enum CastlingVariant {
         KING_SIDE = 0, QUEEN_SIDE = 1
     };
 
-    class GameState;
+    // Castling rights are packed into four bits, one per player and side
+    inline std::uint8_t castling_bit(const Player player, const CastlingVariant variant) {
+        return static_cast<std::uint8_t>(1 << (player * 2 + variant));
+    }
 
+    // Outcome of a position as seen by the side to move. Checkmate takes precedence over the fifty-move rule.
+    enum GameStatus {
+        ONGOING = 0, IN_CHECK = 1, CHECKMATE = 2, STALEMATE = 3, FIFTY_MOVE_DRAW = 4,
+        INSUFFICIENT_MATERIAL_DRAW = 5, REPETITION_DRAW = 6
+    };
+
+    // Contents of a single square: the piece together with its owner (player * 6 + piece), or NO_PIECE
+    typedef std::uint8_t colored_piece;
+    const colored_piece NO_PIECE = 12;
+
+    inline colored_piece make_piece(const Player player, const Piece piece) {
+        return static_cast<colored_piece>(player * 6 + piece);
+    }
+
+    inline Piece type_of(const colored_piece piece) {
+        assert(piece != NO_PIECE);
+        return static_cast<Piece>(piece % 6);
+    }
+
+    inline Player owner_of(const colored_piece piece) {
+        assert(piece != NO_PIECE);
+        return static_cast<Player>(piece / 6);
+    }
+
+    // The four low bits of a move's kind. Bit 2 marks captures and bit 3 promotions; for promotions the two
+    // lowest bits select the promoted piece (QUEEN + bits).
+    enum MoveFlag {
+        QUIET = 0, DOUBLE_PAWN_PUSH = 1, KING_SIDE_CASTLE = 2, QUEEN_SIDE_CASTLE = 3,
+        CAPTURE = 4, EN_PASSANT = 5, PROMOTION = 8, PROMOTION_CAPTURE = 12
+    };
+
+    // A move packed into 16 bits: start square in bits 0-5, finish square in bits 6-11 and the flag in bits 12-15.
+    // Castling is encoded as the king's move.
     class Move {
-    protected:
-        Player to_move;
+    private:
+        std::uint16_t data;
 
     public:
-        explicit Move(Player to_move) : to_move(to_move) {}
+        Move() = default;
 
-        virtual GameState transform(const GameState &state) const = 0;
+        Move(square start, square finish, MoveFlag flag) :
+                data(static_cast<std::uint16_t>(start | (finish << 6) | (flag << 12))) {}
 
-        virtual ~Move() = default;
-    };
+        static Move promotion(square start, square finish, Piece promoted_piece, bool is_capture) {
+            const int flag = (is_capture ? MoveFlag::PROMOTION_CAPTURE : MoveFlag::PROMOTION) |
+                             (promoted_piece - Piece::QUEEN);
+            return {start, finish, static_cast<MoveFlag>(flag)};
+        }
 
-    class NormalMove : public Move {
-    protected:
-        square start, finish;
-        Piece piece;
-        bool is_capture;
+        // The inverse of raw(), for moves stored elsewhere in packed form
+        static Move from_raw(std::uint16_t raw_data) {
+            Move move;
+            move.data = raw_data;
+            return move;
+        }
 
-    public:
-        NormalMove(square start, square finish, Piece piece, Player to_move, bool is_capture) :
-                start(start), finish(finish), piece(piece), Move(to_move), is_capture(is_capture) {}
+        square start() const { return data & 0x3f; }
+
+        square finish() const { return (data >> 6) & 0x3f; }
+
+        MoveFlag flag() const { return static_cast<MoveFlag>(data >> 12); }
 
-        GameState transform(const GameState &state) const override;
+        bool is_capture() const { return (data >> 12) & MoveFlag::CAPTURE; }
 
-        ~NormalMove() override = default;
+        bool is_promotion() const { return (data >> 12) & MoveFlag::PROMOTION; }
+
+        bool is_en_passant() const { return flag() == MoveFlag::EN_PASSANT; }
+
+        bool is_castling() const {
+            return flag() == MoveFlag::KING_SIDE_CASTLE || flag() == MoveFlag::QUEEN_SIDE_CASTLE;
+        }
+
+        Piece promoted_piece() const {
+            assert(is_promotion());
+            return static_cast<Piece>(Piece::QUEEN + ((data >> 12) & 3));
+        }
+
+        std::uint16_t raw() const { return data; }
+
+        bool operator==(const Move &other) const { return data == other.data; }
+
+        bool operator!=(const Move &other) const { return data != other.data; }
     };
 
-    class PromotionMove : public NormalMove {
+    static_assert(sizeof(Move) == 2, "Moves should stay packed into 16 bits");
+    static_assert(std::is_trivially_copyable<Move>::value, "Moves should be copied as plain values");
+
+    // No legal position has more than 218 moves; the extra room keeps pseudo-legal generation safe as well
+    const int MAX_MOVES = 256;
+
+    // Fixed-capacity list of moves with inline storage, so that generating moves never allocates
+    class MoveList {
     private:
-        Piece promoted_piece;
+        Move moves[MAX_MOVES];
+        int count = 0;
 
     public:
-        PromotionMove(square start, square finish, Player to_move, Piece promoted_piece) :
-                NormalMove(start, finish, Piece::PAWN, to_move, false), promoted_piece(promoted_piece) {}
+        void push_back(const Move move) {
+            assert(count < MAX_MOVES);
+            moves[count++] = move;
+        }
+
+        void emplace_back(const square start, const square finish, const MoveFlag flag) {
+            push_back(Move(start, finish, flag));
+        }
+
+        void clear() { count = 0; }
 
-        GameState transform(const GameState &state) const override;
+        int size() const { return count; }
+
+        bool empty() const { return count == 0; }
+
+        Move operator[](const int index) const { return moves[index]; }
+
+        const Move *begin() const { return moves; }
+
+        const Move *end() const { return moves + count; }
     };
 
-    class CastlingMove : public Move {
-    private:
-        CastlingVariant variant;
-    public:
-        CastlingMove(CastlingVariant variant, Player to_move) : Move(to_move), variant(variant) {}
+    // Subsets of the legal moves produced by GameState::generate. CAPTURES holds every capture and promotion,
+    // QUIETS every other move, so together they give LEGAL. EVASIONS is LEGAL for a side in check, and
+    // QUIET_CHECKS are the QUIETS which give check, apart from castling. PSEUDO_LEGAL is a superset of LEGAL
+    // which skips the pin, king safety and en passant tests; GameState::is_legal finishes them per move.
+    enum GenType {
+        CAPTURES = 0, QUIETS = 1, EVASIONS = 2, QUIET_CHECKS = 3, LEGAL = 4, PSEUDO_LEGAL = 5
+    };
+
+    class TranspositionTable;
 
-        GameState transform(const GameState &state) const override;
+    // State which cannot be recovered from a move alone, saved by make_move so that unmake_move can restore it
+    struct Undo {
+        zobrist_key key;
+        bitmap checkers, pinned[2];
+        Piece captured_piece;
+        std::uint8_t castling_rights;
+        std::int8_t en_passant_square;
+        std::uint8_t half_move_counter;
     };
 
     class GameState {
     private:
+        // Piece placement as one bitboard per piece type and one per color, which together fill exactly one
+        // cache line; a player's pieces of one type are the intersection of the two
+        alignas(64) bitmap by_type[6];
+        bitmap by_color[2];
+        // Mailbox mirror of the bitboards, so that the contents of a square can be read directly
+        colored_piece board[64];
+        // Pieces giving check to the side to move and pieces pinned to each king, computed once per position
+        bitmap checking_pieces;
+        bitmap pinned_pieces[2];
+        // Zobrist hash of the pieces, side to move, castling rights and en passant file
+        zobrist_key key;
         Player to_move;
-        bitmap pieces[2][6]{};
-        int half_move_counter;
-        bool can_castle_king_side[2]{}, can_castle_queen_side[2]{};
-        square en_passant_square;
-        // Make sure that moves can access the GameState class
-        friend Move;
-        friend NormalMove;
-        friend PromotionMove;
-        friend CastlingMove;
+        // One bit per player and side, see castling_bit
+        std::uint8_t castling_rights;
+        std::int8_t en_passant_square;
+        // Plies since the last capture or pawn move, saturating at 255
+        std::uint8_t half_move_counter;
 
     public:
         GameState();
 
-        GameState(Player to_move, const bitmap **pieces, int half_move_counter, const bool *can_castle_king_side,
-                  const bool *can_castle_queen_side, square en_passant_square);
+        GameState(Player to_move, const bitmap piece_maps[2][6], int half_move_counter,
+                  const bool *can_castle_king_side, const bool *can_castle_queen_side, square en_passant_square);
 
     private:
-        bitmap span(square, Player, Piece) const;
+        void init_board();
+
+        void put_piece(Player, Piece, square);
 
-        bitmap span_sliding(square, Player, const int *, Piece) const;
+        void remove_piece(Player, Piece, square);
 
-        bitmap span_jumping(square, Player, const int *, Piece) const;
+        bitmap span(square, Player, Piece) const;
 
         bitmap span_king(square, Player) const;
 
@@ -105,18 +211,39 @@ namespace chess {
 
         bitmap span_knight(square, Player) const;
 
-        bitmap span_pawn(square, Player) const;
+        void add_moves(square, bitmap, MoveList &) const;
+
+        template<Player, GenType>
+        void add_pawn_moves(bitmap, bitmap, MoveList &) const;
+
+        template<Player, GenType>
+        void add_pawn_set_moves(bitmap, bitmap, MoveList &) const;
+
+        template<Player, GenType>
+        void add_en_passant_moves(bitmap, MoveList &) const;
+
+        bool en_passant_exposes_king(square start) const;
 
-        bitmap attacking(square, Player, Piece) const;
+        void add_pawn_targets(bitmap, int, MoveFlag, MoveList &) const;
+
+        bitmap attacking(square, Player, Piece, bitmap) const;
 
         bitmap attacking_pawn(square, Player) const;
 
-        bitmap get_occupancy_map() const;
+        bitmap get_checkers() const;
+
+        bitmap get_king_blockers(Player) const;
+
+        bitmap get_pinned(Player) const;
 
-        bool in_check_after_move(const std::unique_ptr<Move> &) const;
+        void update_check_info();
 
+        zobrist_key compute_key() const;
+
+        template<Player>
         bool king_side_castling_conditions_satisfied() const;
 
+        template<Player>
         bool queen_side_castling_conditions_satisfied() const;
 
         bool is_occupied(square) const;
@@ -125,25 +252,145 @@ namespace chess {
 
         square get_king_position(Player player) const;
 
+        Piece get_piece_type(Player, square) const;
+
+        static square get_captured_square(Move);
+
+        void move_castling_rook(Move, Player);
+
         bitmap get_attack_map(Player player) const;
 
+        template<Player>
+        bitmap get_attack_map(bitmap occupancy_map) const;
+
+        template<Player, GenType>
+        void generate_moves(MoveList &) const;
+
+        template<Player>
+        bool has_any_legal_move() const;
+
+        template<Player>
+        int count_legal_moves() const;
+
+        template<Player>
+        int count_pawn_set_moves(bitmap, bitmap) const;
+
+        template<Player>
+        void make_move(Move, Undo &);
+
+        template<Player>
+        void unmake_move(Move, const Undo &);
+
         Player square_ownership(square) const;
 
     public:
+        colored_piece piece_on(square query) const { return board[query]; }
+
+        bitmap pieces(Player player, Piece piece) const { return by_type[piece] & by_color[player]; }
+
+        bitmap pieces(Piece piece) const { return by_type[piece]; }
+
+        bitmap occupancy(Player player) const { return by_color[player]; }
+
+        bitmap occupancy() const { return by_color[Player::WHITE] | by_color[Player::BLACK]; }
+
+        Player side_to_move() const { return to_move; }
+
+        bool can_castle(Player player, CastlingVariant variant) const {
+            return (castling_rights & castling_bit(player, variant)) != 0;
+        }
+
+        square en_passant() const { return en_passant_square; }
+
+        int half_moves() const { return half_move_counter; }
+
+        zobrist_key hash() const { return key; }
+
+        // Pieces of both colors attacking the given square, with sliders seeing through the given occupancy
+        bitmap attackers_to(square, bitmap occupancy_map) const;
+
+        bool is_square_attacked(square, Player by) const;
+
+        bool is_square_attacked(square, Player by, bitmap occupancy_map) const;
+
+        bitmap checkers() const { return checking_pieces; }
+
+        bitmap pinned(Player player) const { return pinned_pieces[player]; }
+
         bool is_check() const;
 
         bool is_checkmate() const;
 
         bool is_stalemate() const;
 
-//    bool is_draw(const std::vector<GameState> &) const;
+        // Stops at the first legal move found; cheaper than generating the whole list
+        bool has_any_legal_move() const;
+
+        GameStatus game_status() const;
+
+        // As above, but also recognizes a threefold repetition of the game given by the keys of the earlier
+        // positions, oldest first
+        GameStatus game_status(const std::vector<zobrist_key> &history) const;
+
+        // Whether the position already occurred in the history (the keys of the earlier positions, oldest
+        // first, not including this one): once if that occurrence is less than search_ply plies back, so
+        // within the current search, and twice otherwise. Only positions since the last capture or pawn
+        // move are compared, and only those with the same side to move.
+        bool is_repetition(const std::vector<zobrist_key> &history, int search_ply = 0) const;
+
+        // Neither side can mate: bare kings, a single minor piece, or bishops all on squares of one color
+        bool is_insufficient_material() const;
+
+        // Repetition as described above, the fifty-move rule unless the side to move is mated, or
+        // insufficient material
+        bool is_draw(const std::vector<zobrist_key> &history, int search_ply = 0) const;
+
+        std::vector<Move> get_valid_moves() const;
 
-        std::vector<std::unique_ptr<Move>> get_valid_moves() const;
+        void generate_legal(MoveList &) const;
+
+        // Replaces the contents of the list with the legal moves of the given kind; EVASIONS requires check
+        template<GenType>
+        void generate(MoveList &) const;
+
+        // Number of legal moves, counted from the target sets without emitting the moves themselves
+        int count_legal_moves() const;
+
+        // Whether a move produced by generate<PSEUDO_LEGAL> in this position leaves the king safe
+        bool is_legal(Move) const;
+
+        // Whether generate<PSEUDO_LEGAL> would produce the move in this position, for moves remembered from
+        // elsewhere (hash and killer moves, client input). Together with is_legal it accepts exactly the
+        // legal moves.
+        bool is_pseudo_legal(Move) const;
+
+        void make_move(Move, Undo &);
+
+        // As above, but first prefetches the table's cluster for the resulting position, so that loading it
+        // overlaps with the work of making the move
+        void make_move(Move, Undo &, const TranspositionTable &);
+
+        void unmake_move(Move, const Undo &);
+
+        // Hash key of the position after the given legal move, without making it
+        zobrist_key key_after(Move) const;
 
 //    std::vector<GameState> reachable_positions() const;
 
+        // Kept for existing callers; new code should use lsb/pop_lsb from bitops.h
         static square get_lowest_bit(bitmap);
     };
+
+    // The piece placement shares its cache line with nothing else, and the whole state spans three lines. Heap
+    // allocations honor the alignment only through the aligned operator new of C++17.
+#ifndef __cpp_aligned_new
+#error "GameState is over-aligned; build with C++17 or -faligned-new"
+#endif
+    static_assert(alignof(GameState) == 64, "Piece bitboards should start a cache line");
+    static_assert(sizeof(GameState) == 192, "GameState should fit in three cache lines");
+
+    // Plays a move that is valid in the given state on a copy of it and returns the resulting state
+    GameState apply_move(const GameState &, Move);
 }
 
 
@@ -0,0 +1,279 @@
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <new>
+#include <sstream>
+#include <thread>
+#include <vector>
+#include "transposition.h"
+
+#if HEPEK_HAS_MMAP
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Requests 2 MB pages whatever the system's default huge page size is: log2 of the size, shifted by
+// MAP_HUGE_SHIFT (26). Older headers lack the name, although kernels since 3.8 accept the flag.
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << 26)
+#endif
+#endif
+
+namespace chess {
+    namespace {
+        // Layout of an entry's data word, from the lowest bits up: move (16), score (16), static evaluation (16),
+        // depth (8), bound (2) and generation (6)
+        const int GENERATION_BITS = 6;
+        const std::uint8_t GENERATION_MASK = (1 << GENERATION_BITS) - 1;
+
+        std::uint64_t pack(const Move move, const int score, const int eval, const int depth, const Bound bound,
+                           const std::uint8_t generation) {
+            return static_cast<std::uint64_t>(move.raw()) |
+                   static_cast<std::uint64_t>(static_cast<std::uint16_t>(score)) << 16 |
+                   static_cast<std::uint64_t>(static_cast<std::uint16_t>(eval)) << 32 |
+                   static_cast<std::uint64_t>(static_cast<std::uint8_t>(depth)) << 48 |
+                   static_cast<std::uint64_t>(bound) << 56 |
+                   static_cast<std::uint64_t>(generation) << 58;
+        }
+
+        TTData unpack(const std::uint64_t data) {
+            TTData result;
+            result.move = Move::from_raw(static_cast<std::uint16_t>(data));
+            result.score = static_cast<std::int16_t>(data >> 16);
+            result.eval = static_cast<std::int16_t>(data >> 32);
+            result.depth = static_cast<std::int8_t>(data >> 48);
+            result.bound = static_cast<Bound>((data >> 56) & 3);
+            return result;
+        }
+
+        std::uint8_t generation_of(const std::uint64_t data) {
+            return static_cast<std::uint8_t>(data >> 58);
+        }
+
+#if HEPEK_HAS_MMAP
+        // Transparent huge pages are only used for 2 MB aligned ranges, and explicit ones are requested at 2 MB
+        const std::size_t HUGE_PAGE_BYTES = 2 * 1024 * 1024;
+
+        // Size of the pages the kernel actually used for the mapping containing the given address, read from
+        // its AnonHugePages line in /proc/self/smaps; the base page size if none of it is huge
+        std::size_t mapped_page_size(const void *address) {
+            const auto base_page_bytes = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+            std::ifstream smaps("/proc/self/smaps");
+            std::string line;
+
+            bool in_mapping = false;
+            while (std::getline(smaps, line)) {
+                std::istringstream fields(line);
+                std::string name;
+                fields >> name;
+
+                // Mapping headers start with the address range, "start-end", in hexadecimal
+                const std::size_t dash = name.find('-');
+                if (dash != std::string::npos && name.back() != ':') {
+                    const auto location = reinterpret_cast<std::uintptr_t>(address);
+                    in_mapping = std::strtoull(name.substr(0, dash).c_str(), nullptr, 16) <= location &&
+                                 location < std::strtoull(name.substr(dash + 1).c_str(), nullptr, 16);
+                } else if (in_mapping && name == "AnonHugePages:") {
+                    std::size_t huge_kilobytes = 0;
+                    fields >> huge_kilobytes;
+                    return (huge_kilobytes > 0) ? HUGE_PAGE_BYTES : base_page_bytes;
+                }
+            }
+
+            return base_page_bytes;
+        }
+#endif
+    }
+
+    TranspositionTable::TranspositionTable(const std::size_t megabytes) {
+        resize(megabytes);
+    }
+
+    TranspositionTable::~TranspositionTable() {
+        release();
+    }
+
+    void TranspositionTable::resize(const std::size_t megabytes, const unsigned thread_count) {
+        release();
+        cluster_count = std::max<std::size_t>(1, megabytes * 1024 * 1024 / sizeof(Cluster));
+        allocate(cluster_count * sizeof(Cluster));
+        clear(thread_count);
+
+#if HEPEK_HAS_MMAP
+        // Pages only exist once touched, so the kernel's choice of transparent huge pages is known after the clear
+        if (page_bytes == 0) page_bytes = mapped_page_size(clusters);
+#endif
+    }
+
+#if HEPEK_HAS_MMAP
+
+    void TranspositionTable::allocate(const std::size_t bytes) {
+        // Explicit huge pages need pages reserved by the administrator and usually fail, in which case
+        // transparent huge pages are requested for an ordinary mapping instead. The page size is given explicitly,
+        // since on hosts whose default is 1 GB the length would otherwise not be a multiple of it.
+        const std::size_t huge_bytes = (bytes + HUGE_PAGE_BYTES - 1) / HUGE_PAGE_BYTES * HUGE_PAGE_BYTES;
+        memory = mmap(nullptr, huge_bytes, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_HUGE_2MB, -1, 0);
+        if (memory != MAP_FAILED) {
+            memory_bytes = huge_bytes;
+            clusters = static_cast<Cluster *>(memory);
+            page_bytes = HUGE_PAGE_BYTES;
+            return;
+        }
+        page_bytes = 0;
+
+        // Over-allocate so that the table can start on a huge page boundary
+        memory_bytes = bytes + HUGE_PAGE_BYTES;
+        memory = mmap(nullptr, memory_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED) {
+            memory = nullptr;
+            memory_bytes = 0;
+            cluster_count = 0;
+            throw std::bad_alloc();
+        }
+
+        const auto address = reinterpret_cast<std::uintptr_t>(memory);
+        clusters = reinterpret_cast<Cluster *>((address + HUGE_PAGE_BYTES - 1) & ~(HUGE_PAGE_BYTES - 1));
+#if defined(MADV_HUGEPAGE)
+        // Failure only means the table is backed by ordinary pages
+        madvise(clusters, bytes, MADV_HUGEPAGE);
+#endif
+    }
+
+    void TranspositionTable::release() {
+        if (memory != nullptr) munmap(memory, memory_bytes);
+        memory = nullptr;
+        memory_bytes = 0;
+        clusters = nullptr;
+        cluster_count = 0;
+    }
+
+#else
+
+    void TranspositionTable::allocate(const std::size_t bytes) {
+        // Clusters have to start on a cache line boundary, which malloc does not promise
+        memory_bytes = bytes + alignof(Cluster) - 1;
+        memory = std::malloc(memory_bytes);
+        if (memory == nullptr) {
+            memory_bytes = 0;
+            cluster_count = 0;
+            throw std::bad_alloc();
+        }
+
+        const auto address = reinterpret_cast<std::uintptr_t>(memory);
+        clusters = reinterpret_cast<Cluster *>((address + alignof(Cluster) - 1) & ~(alignof(Cluster) - 1));
+        page_bytes = 0;
+    }
+
+    void TranspositionTable::release() {
+        std::free(memory);
+        memory = nullptr;
+        memory_bytes = 0;
+        clusters = nullptr;
+        cluster_count = 0;
+    }
+
+#endif
+
+    void TranspositionTable::clear(unsigned thread_count) {
+        const auto start_time = std::chrono::steady_clock::now();
+        if (thread_count == 0) thread_count = std::max(1U, std::thread::hardware_concurrency());
+
+        // All-zero words are an empty entry; the atomics are plain 64-bit integers underneath
+        const std::size_t slice = (cluster_count + thread_count - 1) / thread_count;
+        std::vector<std::thread> threads;
+        for (unsigned i = 0; i < thread_count; ++i) {
+            const std::size_t first = std::min(cluster_count, i * slice);
+            const std::size_t last = std::min(cluster_count, first + slice);
+            threads.emplace_back([this, first, last]() {
+                std::memset(static_cast<void *>(clusters + first), 0, (last - first) * sizeof(Cluster));
+            });
+        }
+        for (std::thread &thread: threads) thread.join();
+
+        generation = 0;
+        clear_milliseconds =
+                std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start_time).count();
+    }
+
+    void TranspositionTable::new_search() {
+        generation = (generation + 1) & GENERATION_MASK;
+    }
+
+    bool TranspositionTable::probe(const zobrist_key key, TTData &data) const {
+        const Cluster &cluster = cluster_of(key);
+
+        for (const Entry &entry: cluster.entries) {
+            const std::uint64_t entry_data = entry.data.load(std::memory_order_relaxed);
+            const std::uint64_t key_xor_data = entry.key_xor_data.load(std::memory_order_relaxed);
+            if ((key_xor_data ^ entry_data) == key && (entry_data | key_xor_data) != 0) {
+                data = unpack(entry_data);
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    void TranspositionTable::store(const zobrist_key key, Move move, const int score, const int eval, const int depth,
+                                   const Bound bound) {
+        assert(score >= INT16_MIN && score <= INT16_MAX && depth >= INT8_MIN && depth <= INT8_MAX);
+        Cluster &cluster = cluster_of(key);
+        Entry *replaced = nullptr;
+        int lowest_value = INT_MAX;
+
+        for (Entry &entry: cluster.entries) {
+            const std::uint64_t entry_data = entry.data.load(std::memory_order_relaxed);
+            const std::uint64_t key_xor_data = entry.key_xor_data.load(std::memory_order_relaxed);
+
+            // The same position is always overwritten, unless a much deeper result from this search would be
+            // lost. Its move is kept if the new result has none.
+            if ((key_xor_data ^ entry_data) == key && (entry_data | key_xor_data) != 0) {
+                const TTData old = unpack(entry_data);
+                if (bound != Bound::EXACT_BOUND && depth < old.depth - 4 && generation_of(entry_data) == generation) {
+                    return;
+                }
+                if (move == Move(0, 0, MoveFlag::QUIET)) move = old.move;
+                replaced = &entry;
+                break;
+            }
+
+            // Otherwise the entry replaced is the shallowest one, with every search of age counting as 8 plies
+            const int age = (generation - generation_of(entry_data)) & GENERATION_MASK;
+            const int value = ((entry_data | key_xor_data) == 0) ? INT_MIN : unpack(entry_data).depth - 8 * age;
+            if (value < lowest_value) {
+                lowest_value = value;
+                replaced = &entry;
+            }
+        }
+
+        const std::uint64_t data = pack(move, score, eval, depth, bound, generation);
+        replaced->key_xor_data.store(key ^ data, std::memory_order_relaxed);
+        replaced->data.store(data, std::memory_order_relaxed);
+    }
+
+    std::string TranspositionTable::allocation_info() const {
+        std::ostringstream info;
+        info << "hash " << size_in_bytes() / (1024 * 1024) << " MB, ";
+        if (page_bytes > 0) info << page_bytes / 1024 << " kB pages, ";
+        info << "cleared in " << static_cast<long long>(clear_milliseconds + 0.5) << " ms";
+        return info.str();
+    }
+
+    int TranspositionTable::hashfull() const {
+        const std::size_t sampled_clusters = std::min<std::size_t>(250, cluster_count);
+        int used = 0;
+
+        for (std::size_t i = 0; i < sampled_clusters; ++i) {
+            for (const Entry &entry: clusters[i].entries) {
+                const std::uint64_t entry_data = entry.data.load(std::memory_order_relaxed);
+                if (entry_data != 0 && generation_of(entry_data) == generation) ++used;
+            }
+        }
+
+        return static_cast<int>(used * 1000 / (sampled_clusters * CLUSTER_SIZE));
+    }
+}
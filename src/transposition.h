@@ -0,0 +1,136 @@
+#ifndef HEPEK_CHESS_ENGINE_TRANSPOSITION_H
+#define HEPEK_CHESS_ENGINE_TRANSPOSITION_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include "rules.h"
+
+// On Linux the table is mapped directly and backed by huge pages where the kernel allows it
+#if defined(__linux__)
+#define HEPEK_HAS_MMAP 1
+#else
+#define HEPEK_HAS_MMAP 0
+#endif
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86)) && !defined(__clang__)
+#include <xmmintrin.h>
+#endif
+
+namespace chess {
+    // How a stored score relates to the true value of the position
+    enum Bound : std::uint8_t {
+        NO_BOUND = 0, UPPER_BOUND = 1, LOWER_BOUND = 2, EXACT_BOUND = 3
+    };
+
+    // Everything a probe returns about a position
+    struct TTData {
+        Move move;
+        std::int16_t score;
+        std::int16_t eval;
+        std::int8_t depth;
+        Bound bound;
+    };
+
+    // Hash table of search results shared by all search threads without locking. Entries are grouped into
+    // 64-byte clusters, so that a probe touches a single cache line. Each entry is two 64-bit words written
+    // independently, the first holding the key XOR-ed with the second; an entry torn by a concurrent write
+    // then fails verification and reads as a miss instead of returning another position's data.
+    class TranspositionTable {
+    private:
+        struct Entry {
+            std::atomic<std::uint64_t> key_xor_data;
+            std::atomic<std::uint64_t> data;
+        };
+
+        static const int CLUSTER_SIZE = 4;
+
+        struct alignas(64) Cluster {
+            Entry entries[CLUSTER_SIZE];
+        };
+
+        static_assert(sizeof(Cluster) == 64, "A cluster should fill exactly one cache line");
+
+        // The block obtained from the system, which the clusters are aligned within
+        void *memory = nullptr;
+        std::size_t memory_bytes = 0;
+        Cluster *clusters = nullptr;
+        std::size_t cluster_count = 0;
+        // Bumped once per search, so that entries left over from earlier searches can be told apart
+        std::uint8_t generation = 0;
+        // Size of the pages backing the table as reported by the system, and how long the last clear took
+        std::size_t page_bytes = 0;
+        double clear_milliseconds = 0;
+
+        Cluster &cluster_of(zobrist_key key) const;
+
+        void allocate(std::size_t bytes);
+
+        void release();
+
+    public:
+        explicit TranspositionTable(std::size_t megabytes);
+
+        ~TranspositionTable();
+
+        TranspositionTable(const TranspositionTable &) = delete;
+
+        TranspositionTable &operator=(const TranspositionTable &) = delete;
+
+        // Reallocates the table with the given size in megabytes, dropping its contents. Clearing the new table
+        // is split between the given number of threads, 0 meaning one per hardware thread.
+        void resize(std::size_t megabytes, unsigned thread_count = 0);
+
+        // Zeroes the table, with every thread taking a contiguous slice. The threads are also the first to
+        // touch their slices, which places them on the threads' own NUMA nodes.
+        void clear(unsigned thread_count = 0);
+
+        // Starts a new search; entries from earlier searches become the first to be replaced
+        void new_search();
+
+        // Fills in the data and returns true if the position is stored
+        bool probe(zobrist_key key, TTData &data) const;
+
+        void store(zobrist_key key, Move move, int score, int eval, int depth, Bound bound);
+
+        // Permille of sampled entries written during the current search
+        int hashfull() const;
+
+        std::size_t size_in_bytes() const { return cluster_count * sizeof(Cluster); }
+
+        std::size_t page_size() const { return page_bytes; }
+
+        double last_clear_milliseconds() const { return clear_milliseconds; }
+
+        // One line for the engine's info output, e.g. "hash 1024 MB, 2048 kB pages, cleared in 35 ms"
+        std::string allocation_info() const;
+
+        // Start of the cluster the key maps to, for prefetching it ahead of a probe
+        const void *cluster_address(zobrist_key key) const { return &cluster_of(key); }
+
+        // Starts loading the key's cluster into the cache, so that a later probe or store does not stall on it
+        void prefetch(zobrist_key key) const {
+#if defined(__GNUC__) || defined(__clang__)
+            __builtin_prefetch(cluster_address(key));
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+            _mm_prefetch(static_cast<const char *>(cluster_address(key)), _MM_HINT_T0);
+#else
+            (void) key;
+#endif
+        }
+    };
+
+    inline TranspositionTable::Cluster &TranspositionTable::cluster_of(const zobrist_key key) const {
+        // Maps the key uniformly onto [0, cluster_count) without a division
+#if defined(__SIZEOF_INT128__)
+        const auto index = static_cast<std::size_t>((static_cast<unsigned __int128>(key) * cluster_count) >> 64);
+#else
+        const auto index = static_cast<std::size_t>(key % cluster_count);
+#endif
+        return clusters[index];
+    }
+}
+
+
+#endif //HEPEK_CHESS_ENGINE_TRANSPOSITION_H
@@ -0,0 +1,48 @@
+#include "zobrist.h"
+
+namespace chess {
+    namespace zobrist {
+        zobrist_key piece_square[12][64];
+        zobrist_key black_to_move;
+        zobrist_key castling[16];
+        zobrist_key en_passant_file[8];
+    }
+
+    namespace {
+        // xorshift64*; a fixed seed keeps keys, and thus anything stored by hash, the same between runs
+        zobrist_key next_random(zobrist_key &state) {
+            state ^= state >> 12;
+            state ^= state << 25;
+            state ^= state >> 27;
+            return state * 0x2545f4914f6cdd1dULL;
+        }
+
+        void build_zobrist_keys() {
+            zobrist_key state = 0x9e3779b97f4a7c15ULL;
+            for (auto &piece_keys: zobrist::piece_square) {
+                for (zobrist_key &key: piece_keys) key = next_random(state);
+            }
+            zobrist::black_to_move = next_random(state);
+
+            // Every combination of rights gets its own key, so that a change of rights is a single XOR
+            for (zobrist_key &key: zobrist::castling) key = next_random(state);
+            zobrist::castling[0] = 0;
+
+            for (zobrist_key &key: zobrist::en_passant_file) key = next_random(state);
+        }
+
+        // Builds the keys eagerly at startup. GameState calls init_zobrist_keys itself, since its static
+        // instances in other translation units may be constructed before this object.
+        struct ZobristInitializer {
+            ZobristInitializer() {
+                init_zobrist_keys();
+            }
+        } zobrist_initializer;
+    }
+
+    void init_zobrist_keys() {
+        // A function-local static is initialized exactly once, even when several threads arrive together
+        static const bool initialized = (build_zobrist_keys(), true);
+        (void) initialized;
+    }
+}
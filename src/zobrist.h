@@ -0,0 +1,24 @@
+#ifndef HEPEK_CHESS_ENGINE_ZOBRIST_H
+#define HEPEK_CHESS_ENGINE_ZOBRIST_H
+
+#include <cstdint>
+#include "bitops.h"
+
+namespace chess {
+    typedef std::uint64_t zobrist_key;
+
+    // Random keys XOR-ed together into a position's hash, filled in once by init_zobrist_keys. Pieces are
+    // indexed by colored piece (player * 6 + piece) and square.
+    namespace zobrist {
+        extern zobrist_key piece_square[12][64];
+        extern zobrist_key black_to_move;
+        extern zobrist_key castling[16];
+        extern zobrist_key en_passant_file[8];
+    }
+
+    // Fills in the keys on first call; later calls return at once. Safe to call from several threads.
+    void init_zobrist_keys();
+}
+
+
+#endif //HEPEK_CHESS_ENGINE_ZOBRIST_H
@@ -0,0 +1,62 @@
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include "rules.h"
+
+using namespace chess;
+
+namespace {
+    std::uint64_t allocations = 0;
+
+    std::uint64_t perft(GameState &state, const int depth) {
+        MoveList moves;
+        state.generate_legal(moves);
+        if (depth == 0) return 1;
+
+        std::uint64_t nodes = 0;
+        Undo undo;
+        for (const Move move : moves) {
+            state.make_move(move, undo);
+            nodes += perft(state, depth - 1);
+            state.unmake_move(move, undo);
+        }
+        return nodes;
+    }
+}
+
+// Counts every heap allocation made by the program
+void *operator new(const std::size_t size) {
+    ++allocations;
+    if (void *memory = std::malloc(size == 0 ? 1 : size)) return memory;
+    throw std::bad_alloc();
+}
+
+void operator delete(void *memory) noexcept {
+    std::free(memory);
+}
+
+void operator delete(void *memory, std::size_t) noexcept {
+    std::free(memory);
+}
+
+// Move generation and make/unmake must not touch the heap
+int main() {
+    GameState state;
+
+    const std::uint64_t before = allocations;
+    const std::uint64_t nodes = perft(state, 4);
+    const std::uint64_t allocated = allocations - before;
+
+    std::printf("perft(4) = %llu, %llu allocations\n", static_cast<unsigned long long>(nodes),
+                static_cast<unsigned long long>(allocated));
+    if (nodes != 197281) {
+        std::printf("FAILED: expected 197281 nodes\n");
+        return 1;
+    }
+    if (allocated != 0) {
+        std::printf("FAILED: expected no allocations\n");
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,29 @@
+#include <cstdio>
+#include "rules.h"
+
+using namespace chess;
+
+namespace {
+    // Constructed during static initialization, possibly before the library's own tables are built: this file is
+    // linked ahead of the library, so its initializers tend to run first
+    const GameState initial_state;
+}
+
+int main() {
+    const int legal_moves = initial_state.count_legal_moves();
+    std::printf("%d legal moves in the static start position\n", legal_moves);
+    if (legal_moves != 20) {
+        std::printf("FAILED: expected 20 legal moves\n");
+        return 1;
+    }
+
+    // A key computed from unfilled Zobrist tables would be zero
+    GameState fresh_state;
+    std::printf("static key %016llx, fresh key %016llx\n", static_cast<unsigned long long>(initial_state.hash()),
+                static_cast<unsigned long long>(fresh_state.hash()));
+    if (initial_state.hash() == 0 || initial_state.hash() != fresh_state.hash()) {
+        std::printf("FAILED: the static start position has the wrong key\n");
+        return 1;
+    }
+    return 0;
+}